@@ -21,10 +21,15 @@ cc() {
 
 cp src/nsc.h ./nsc.h
 nsc main.c
+nsc arena.c
 nsc type.c
 nsc parser.c
 nsc codegen.c
 nsc tokenizer.c
+nsc token_cache.c
+nsc hashmap.c
+nsc prefetch.c
+nsc pch.c
 nsc preprocessor.c
 
-(cd $TMP; gcc -o ../$OUTPUT *.o)
\ No newline at end of file
+(cd $TMP; gcc -pthread -o ../$OUTPUT *.o)
\ No newline at end of file
@@ -0,0 +1,111 @@
+#include "nsc.h"
+
+// Objects created by the compiler live until the phase that uses them
+// is done, so instead of allocating each of them with calloc(), we
+// carve them out of large blocks with a bump pointer. All objects in
+// an arena are freed at once by arena_reset() or arena_release().
+
+#define ARENA_BLOCK_SIZE (256 * 1024)
+
+// The payload of a block follows its 16-byte header, so it is aligned
+// as malloc() aligns the block.
+struct ArenaBlock {
+    ArenaBlock *next;
+    char *end;
+};
+
+Arena token_arena = {"tokens"};
+Arena pp_arena = {"preprocessor"};
+Arena ast_arena = {"ast"};
+Arena type_arena = {"types"};
+
+static char *block_data(ArenaBlock *blk) {
+    return (char *)(blk + 1);
+}
+
+static ArenaBlock *new_block(Arena *arena, size_t size) {
+    ArenaBlock *blk = malloc(sizeof(ArenaBlock) + size);
+    if (!blk)
+        error("out of memory");
+    blk->end = block_data(blk) + size;
+    arena->reserved += size;
+    if (arena->peak < arena->reserved)
+        arena->peak = arena->reserved;
+    return blk;
+}
+
+// Returns a zero-cleared memory region of `size` bytes.
+void *arena_alloc(Arena *arena, size_t size) {
+    size = align_to(size, 16);
+    arena->allocated += size;
+    arena->nallocs++;
+
+    if (arena->ptr + size > arena->end) {
+        // A large object gets its own block so that we don't waste
+        // the rest of the current block.
+        if (size > ARENA_BLOCK_SIZE / 4) {
+            ArenaBlock *blk = new_block(arena, size);
+            if (arena->blocks) {
+                blk->next = arena->blocks->next;
+                arena->blocks->next = blk;
+            } else {
+                blk->next = NULL;
+                arena->blocks = blk;
+                arena->ptr = arena->end = blk->end;
+            }
+            memset(block_data(blk), 0, size);
+            return block_data(blk);
+        }
+
+        ArenaBlock *blk = new_block(arena, ARENA_BLOCK_SIZE);
+        blk->next = arena->blocks;
+        arena->blocks = blk;
+        arena->ptr = block_data(blk);
+        arena->end = blk->end;
+    }
+
+    void *p = arena->ptr;
+    arena->ptr += size;
+    memset(p, 0, size);
+    return p;
+}
+
+char *arena_strndup(Arena *arena, char *s, int len) {
+    char *buf = arena_alloc(arena, len + 1);
+    memcpy(buf, s, len);
+    return buf;
+}
+
+// Frees all objects in a given arena but keeps its most recently
+// allocated block for reuse.
+void arena_reset(Arena *arena) {
+    if (!arena->blocks)
+        return;
+
+    ArenaBlock *blk = arena->blocks;
+    ArenaBlock *next;
+    for (ArenaBlock *b = blk->next; b; b = next) {
+        next = b->next;
+        long size = b->end - block_data(b);
+        arena->reserved -= size;
+        free(b);
+    }
+
+    blk->next = NULL;
+    arena->ptr = block_data(blk);
+    arena->end = blk->end;
+}
+
+// Frees all objects in a given arena and returns its memory to the
+// system.
+void arena_release(Arena *arena) {
+    arena_reset(arena);
+    if (!arena->blocks)
+        return;
+
+    long size = arena->blocks->end - block_data(arena->blocks);
+    arena->reserved -= size;
+    free(arena->blocks);
+    arena->blocks = NULL;
+    arena->ptr = arena->end = NULL;
+}
@@ -253,7 +253,7 @@ static void builtin_va_start(Node *node) {
 
 // Generate code for a given node.
 static void gen_expr(Node *node) {
-    printf(".loc %d %d\n", node->tok->file_no, node->tok->line_no);
+    printf(".loc %d %d\n", get_file(node->tok)->file_no, get_line_no(node->tok));
 
     switch (node->kind) {
         case ND_NUM:
@@ -600,7 +600,7 @@ static void gen_expr(Node *node) {
 }
 
 static void gen_stmt(Node *node) {
-    printf(".loc %d %d\n", node->tok->file_no, node->tok->line_no);
+    printf(".loc %d %d\n", get_file(node->tok)->file_no, get_line_no(node->tok));
 
     switch (node->kind) {
         case ND_IF: {
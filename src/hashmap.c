@@ -0,0 +1,79 @@
+#include "nsc.h"
+
+// A string-keyed hash table with open addressing and linear probing.
+// Keys are not copied, so they must outlive the map. The table is
+// allocated with calloc() and is never more than half full.
+
+#define INIT_CAPACITY 64
+
+static HashEntry *get_entry(HashMap *map, char *key, int keylen) {
+    if (!map->buckets)
+        return NULL;
+
+    unsigned int hash = hash_string(key, keylen);
+    for (int i = hash & (map->capacity - 1);; i = (i + 1) & (map->capacity - 1)) {
+        HashEntry *ent = &map->buckets[i];
+        if (!ent->key)
+            return NULL;
+        if (ent->hash == hash && ent->keylen == keylen &&
+            !memcmp(ent->key, key, keylen))
+            return ent;
+    }
+}
+
+static void rehash(HashMap *map) {
+    HashMap map2 = {};
+    map2.capacity = map->capacity ? map->capacity * 2 : INIT_CAPACITY;
+    map2.buckets = calloc(map2.capacity, sizeof(HashEntry));
+
+    for (int i = 0; i < map->capacity; i++) {
+        HashEntry *ent = &map->buckets[i];
+        if (!ent->key)
+            continue;
+
+        int j = ent->hash & (map2.capacity - 1);
+        while (map2.buckets[j].key)
+            j = (j + 1) & (map2.capacity - 1);
+        map2.buckets[j] = *ent;
+        map2.used++;
+    }
+
+    free(map->buckets);
+    *map = map2;
+}
+
+void *hashmap_get(HashMap *map, char *key) {
+    return hashmap_get2(map, key, strlen(key));
+}
+
+void *hashmap_get2(HashMap *map, char *key, int keylen) {
+    HashEntry *ent = get_entry(map, key, keylen);
+    return ent ? ent->val : NULL;
+}
+
+void hashmap_put(HashMap *map, char *key, void *val) {
+    hashmap_put2(map, key, strlen(key), val);
+}
+
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val) {
+    HashEntry *ent = get_entry(map, key, keylen);
+    if (ent) {
+        ent->val = val;
+        return;
+    }
+
+    if ((map->used + 1) * 2 > map->capacity)
+        rehash(map);
+
+    unsigned int hash = hash_string(key, keylen);
+    int i = hash & (map->capacity - 1);
+    while (map->buckets[i].key)
+        i = (i + 1) & (map->capacity - 1);
+
+    ent = &map->buckets[i];
+    ent->key = key;
+    ent->keylen = keylen;
+    ent->hash = hash;
+    ent->val = val;
+    map->used++;
+}
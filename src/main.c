@@ -1,14 +1,28 @@
 #include "nsc.h"
 
 bool opt_E;
+bool opt_emit_pch;
 bool opt_fpic = true;
+bool opt_stats;
+bool opt_pp_stats;
+char *opt_token_cache;
+int opt_prefetch_threads;
 
 char **include_paths;
 
+static bool opt_P;
+static bool opt_pp_stats_json;
+static bool opt_M;   // -M or -MM
+static bool opt_MD;  // -MD or -MMD
+static bool opt_MM;  // -MM or -MMD: leave out system headers
+static bool opt_MP;
+static char *opt_MF;
+static char *opt_include_pch;
 static char *input_file;
+static char *output_file;
 
 static void usage(void) {
-    fprintf(stderr, "chibicc [ -I<path> ] [ -o <path> ] <file>\n");
+    fprintf(stderr, "chibicc [ -I<path> ] [ -o <path> ] [ -include-pch <path> ] <file>\n");
     exit(1);
 }
 
@@ -49,18 +63,67 @@ static void parse_args(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(argv[i], "-P")) {
+            opt_P = true;
+            continue;
+        }
+
         if (!strcmp(argv[i], "-o")) {
             if (!argv[++i])
                 usage();
+            output_file = argv[i];
             redirect_stdout(argv[i]);
             continue;
         }
 
         if (!strncmp(argv[i], "-o", 2)) {
+            output_file = argv[i] + 2;
             redirect_stdout(argv[i] + 2);
             continue;
         }
 
+        // -M and -MM print dependencies instead of preprocessed output.
+        if (!strcmp(argv[i], "-M") || !strcmp(argv[i], "-MM")) {
+            opt_M = opt_E = true;
+            opt_MM = (argv[i][2] == 'M');
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-MD") || !strcmp(argv[i], "-MMD")) {
+            opt_MD = true;
+            opt_MM = (argv[i][2] == 'M');
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-MP")) {
+            opt_MP = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-MF")) {
+            if (!argv[++i])
+                usage();
+            opt_MF = argv[i];
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-MF", 3)) {
+            opt_MF = argv[i] + 3;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "--emit-pch")) {
+            opt_emit_pch = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-include-pch")) {
+            if (!argv[++i])
+                usage();
+            opt_include_pch = argv[i];
+            continue;
+        }
+
         if (!strcmp(argv[i], "-D")) {
             if (!argv[++i])
                 usage();
@@ -83,6 +146,36 @@ static void parse_args(int argc, char **argv) {
             continue;
         }
 
+        if (!strcmp(argv[i], "-fstats")) {
+            opt_stats = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fpp-stats")) {
+            opt_pp_stats = true;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fpp-stats=json")) {
+            opt_pp_stats = opt_pp_stats_json = true;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-ftoken-cache=", 14)) {
+            opt_token_cache = argv[i] + 14;
+            continue;
+        }
+
+        if (!strcmp(argv[i], "-fprefetch-includes")) {
+            opt_prefetch_threads = 2;
+            continue;
+        }
+
+        if (!strncmp(argv[i], "-fprefetch-includes=", 20)) {
+            opt_prefetch_threads = atoi(argv[i] + 20);
+            continue;
+        }
+
         if (argv[i][0] == '-' && argv[i][1] != '\0')
             error("unknown argument: %s", argv[i]);
 
@@ -95,35 +188,300 @@ static void parse_args(int argc, char **argv) {
         error("no input files");
 }
 
-static void print_tokens(Token *tok) {
-    int line = 1;
-    for (; tok->kind != TK_EOF; tok = tok->next) {
-        if (line > 1 && tok->at_bol)
-            printf("\n");
-        if (tok->has_space && !tok->at_bol)
-            printf(" ");
-        printf("%.*s", tok->len, tok->loc);
-        line++;
+// Returns the current time in nanoseconds.
+long now_nsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// Prints compiler statistics to stderr.
+static void print_stats(void) {
+    TokenizeStats *s = &tokenize_stats;
+    double sec = s->nsec / 1e9;
+    fprintf(stderr, "tokenize: %ld files, %ld bytes, %ld tokens in %.3f ms\n",
+            s->files, s->bytes, s->tokens, sec * 1e3);
+    if (s->skipped)
+        fprintf(stderr, "tokenize: %ld bytes skipped in excluded groups\n", s->skipped);
+    if (s->nsec > 0)
+        fprintf(stderr, "tokenize: %.0f tokens/sec, %.1f MB/sec\n",
+                s->tokens / sec, s->bytes / sec / 1e6);
+    if (opt_token_cache)
+        fprintf(stderr, "token cache: %ld hits, %ld misses\n",
+                s->cache_hits, s->cache_misses);
+    IncludeStats *is = &include_stats;
+    fprintf(stderr, "include: %ld cache hits, %ld stat calls, %ld stat calls saved\n",
+            is->cache_hits, is->stats, is->stats_saved);
+    if (opt_prefetch_threads) {
+        PrefetchStats *ps = &prefetch_stats;
+        fprintf(stderr, "prefetch: %ld hits (%ld waited), %ld misses\n",
+                ps->hits, ps->waits, ps->misses);
     }
-    printf("\n");
+
+    Arena *arenas[] = {&token_arena, &pp_arena, &ast_arena, &type_arena};
+    for (int i = 0; i < sizeof(arenas) / sizeof(*arenas); i++) {
+        Arena *a = arenas[i];
+        fprintf(stderr, "arena %s: %ld bytes in %ld allocations, peak %ld bytes\n",
+                a->name, a->allocated, a->nallocs, a->peak);
+    }
+}
+
+// Returns `path` with the suffix of its last component replaced by
+// `extn`.
+static char *replace_extn(char *path, char *extn) {
+    char *base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+    char *dot = strrchr(base, '.');
+    int len = dot ? dot - path : strlen(path);
+
+    char *buf = malloc(len + strlen(extn) + 1);
+    sprintf(buf, "%.*s%s", len, path, extn);
+    return buf;
+}
+
+// Writes a filename escaped for make.
+static void write_make_name(FILE *out, char *name) {
+    for (char *p = name; *p; p++) {
+        if (*p == ' ' || *p == '\t' || *p == '#')
+            fputc('\\', out);
+        else if (*p == '$')
+            fputc('$', out);
+        fputc(*p, out);
+    }
+}
+
+// Writes a make rule listing the files the input depends on to `path`,
+// or to stdout if `path` is NULL. The target is the -o file with -MD,
+// otherwise the input filename without its directory and with the
+// suffix ".o". -MP adds an empty rule for each header so
+// that make does not fail when a header is removed.
+static void write_dependencies(char *path) {
+    FILE *out = stdout;
+    if (path && strcmp(path, "-")) {
+        out = fopen(path, "w");
+        if (!out)
+            error("cannot open dependency file %s: %s", path, strerror(errno));
+    }
+
+    char *target;
+    if (opt_MD && output_file && strcmp(output_file, "-")) {
+        target = output_file;
+    } else {
+        char *base = strrchr(input_file, '/');
+        target = replace_extn(base ? base + 1 : input_file, ".o");
+    }
+
+    write_make_name(out, target);
+    fputs(": ", out);
+    write_make_name(out, input_file);
+
+    for (Dependency *dep = dependencies; dep; dep = dep->next) {
+        if (opt_MM && dep->is_system)
+            continue;
+        fputs(" \\\n  ", out);
+        write_make_name(out, dep->path);
+    }
+    fputc('\n', out);
+
+    if (opt_MP) {
+        for (Dependency *dep = dependencies; dep; dep = dep->next) {
+            if (opt_MM && dep->is_system)
+                continue;
+            fputc('\n', out);
+            write_make_name(out, dep->path);
+            fputs(":\n", out);
+        }
+    }
+
+    if (out == stdout ? fflush(out) : fclose(out))
+        error("cannot write dependency file: %s", strerror(errno));
+}
+
+// Returns the file that -MD writes dependencies to: the -MF file, or
+// the output file or else the input filename with the suffix ".d".
+static char *dependency_file(void) {
+    if (opt_MF)
+        return opt_MF;
+    if (output_file && strcmp(output_file, "-"))
+        return replace_extn(output_file, ".d");
+    char *base = strrchr(input_file, '/');
+    return replace_extn(base ? base + 1 : input_file, ".d");
+}
+
+static void discard_token(Token *tok, Token *origin) {}
+
+// The -E output is written as the preprocessor produces it, through a
+// large buffer that is flushed with write(2). Like GCC, the writer
+// keeps output lines in step with the source lines, inserting up to 8
+// blank lines and otherwise a linemarker of the form
+//
+//   # <line> "<file>" <flags>
+//
+// where flag 1 means that a file was entered and flag 2 means that it
+// was returned to. -P replaces linemarkers with a newline.
+static char out_buf[1 << 18];
+static int out_len;
+
+static void flush_output(void) {
+    for (char *p = out_buf; p < out_buf + out_len;) {
+        ssize_t n = write(STDOUT_FILENO, p, out_buf + out_len - p);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            error("write error: %s", strerror(errno));
+        p += n;
+    }
+    out_len = 0;
+}
+
+static void write_output(char *p, int len) {
+    while (len > 0) {
+        if (out_len == sizeof(out_buf))
+            flush_output();
+        int n = sizeof(out_buf) - out_len;
+        if (n > len)
+            n = len;
+        memcpy(out_buf + out_len, p, n);
+        out_len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+static void write_char(char c) {
+    if (out_len == sizeof(out_buf))
+        flush_output();
+    out_buf[out_len++] = c;
+}
+
+// State of the -E writer
+static int out_file_no;      // File number of the current output line
+static int out_line;         // Source line of the current output line
+static bool out_bol = true;  // Nothing has been written on the line
+static Token *out_origin;    // Origin of the last token written
+
+static void write_linemarker(File *file, int line, int flag) {
+    if (!out_bol)
+        write_char('\n');
+    out_bol = true;
+    if (opt_P)
+        return;
+
+    char buf[32];
+    write_output(buf, sprintf(buf, "# %d \"", line));
+    for (char *p = file->name; *p; p++) {
+        if (*p == '"' || *p == '\\')
+            write_char('\\');
+        write_char(*p);
+    }
+    write_char('"');
+    if (flag)
+        write_output(buf, sprintf(buf, " %d", flag));
+    write_char('\n');
+}
+
+// Called by the preprocessor when it enters a file (flag 1) or returns
+// to one (flag 2). `tok` is the next token to be read from the file.
+static void print_file_change(Token *tok, int flag) {
+    File *file = get_file(tok);
+    out_line = get_line_no(tok);
+    out_file_no = file->file_no;
+    write_linemarker(file, out_line, flag);
+}
+
+// Starts a new output line for a token at the beginning of a line.
+static void move_to(Token *origin) {
+    File *file = get_file(origin);
+    int line = get_line_no(origin);
+
+    if (file->file_no != out_file_no || line < out_line || line - out_line > 8) {
+        out_file_no = file->file_no;
+        write_linemarker(file, line, 0);
+    } else if (!out_bol || line > out_line) {
+        for (int i = out_line; i < line; i++)
+            write_char('\n');
+        out_bol = true;
+    }
+    out_line = line;
+}
+
+static void print_token(Token *tok, Token *origin) {
+    // The first token of a macro expansion is also spaced like the
+    // macro invocation.
+    bool first = (origin != out_origin);
+    if (first && origin->at_bol)
+        move_to(origin);
+    else if ((tok->has_space || (first && origin->has_space)) && !out_bol)
+        write_char(' ');
+    out_origin = origin;
+
+    write_output(tok->loc, tok->len);
+    out_bol = false;
 }
 
 int main(int argc, char **argv) {
     init_macros();
     parse_args(argc, argv);
 
+    if (opt_include_pch)
+        load_pch(opt_include_pch);
+
     // Tokenize and parse.
     Token *tok = tokenize_file(input_file);
     if (!tok)
         error("%s: %s", input_file, strerror(errno));
 
-    tok = preprocess(tok);
+    // -M stops after preprocessing.
+    if (opt_M) {
+        preprocess_stream(tok, discard_token, NULL);
+        write_dependencies(opt_MF);
+        if (opt_pp_stats)
+            print_pp_stats(opt_pp_stats_json);
+        if (opt_stats)
+            print_stats();
+        exit(0);
+    }
 
     if (opt_E) {
-        print_tokens(tok);
+        preprocess_stream(tok, print_token, print_file_change);
+        if (!out_bol)
+            write_char('\n');
+        flush_output();
+        if (opt_MD)
+            write_dependencies(dependency_file());
+        if (opt_pp_stats)
+            print_pp_stats(opt_pp_stats_json);
+        if (opt_stats)
+            print_stats();
         exit(0);
     }
 
+    tok = preprocess(tok);
+    if (opt_MD)
+        write_dependencies(dependency_file());
+    if (opt_pp_stats)
+        print_pp_stats(opt_pp_stats_json);
+
+    // --emit-pch writes the macros and the parser state to the -o file,
+    // or to the input filename with the suffix ".pch".
+    if (opt_emit_pch) {
+        Program *prog = parse(tok);
+        char *path = output_file;
+        if (!path || !strcmp(path, "-")) {
+            path = malloc(strlen(input_file) + 5);
+            sprintf(path, "%s.pch", input_file);
+        }
+        write_pch(input_file, path, prog);
+        if (opt_stats)
+            print_stats();
+        exit(0);
+    }
+
+    // Macros and hidesets are no longer needed once the input has been
+    // preprocessed. Tokens still point to their hidesets, but nothing
+    // after this point reads them.
+    arena_release(&pp_arena);
+
     Program *prog = parse(tok);
 
     // Assign offsets to local variables.
@@ -143,5 +501,8 @@ int main(int argc, char **argv) {
     // Traverse the AST to emit assembly.
     codegen(prog);
 
+    if (opt_stats)
+        print_stats();
+
     return 0;
 }
\ No newline at end of file
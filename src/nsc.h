@@ -2,20 +2,55 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 typedef struct Type Type;
 typedef struct Hideset Hideset;
 typedef struct Member Member;
 typedef struct Relocation Relocation;
+typedef struct PchWriter PchWriter;
+typedef struct Pch Pch;
+
+//
+// arena.c
+//
+
+typedef struct ArenaBlock ArenaBlock;
+
+// Bump-pointer allocator for objects that share a lifetime
+typedef struct {
+    char *name;          // Name shown by -fstats
+    ArenaBlock *blocks;  // Blocks obtained from malloc
+    char *ptr;           // Next free byte in the current block
+    char *end;           // End of the current block
+    long allocated;      // Total bytes ever allocated
+    long nallocs;        // Total number of allocations
+    long reserved;       // Bytes currently held from malloc
+    long peak;           // Maximum of `reserved`
+} Arena;
+
+extern Arena token_arena;  // Tokens, atoms and literal contents
+extern Arena pp_arena;     // Macros, hidesets and other preprocessor data
+extern Arena ast_arena;    // Nodes, variables and scopes
+extern Arena type_arena;   // Types and struct members
+
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, char *s, int len);
+void arena_reset(Arena *arena);
+void arena_release(Arena *arena);
 
 //
 // tokenize.c
@@ -29,48 +64,191 @@ typedef enum {
     TK_NUM,       // Numeric literals
     TK_PP_NUM,    // Preprocessing numbers
     TK_EOF,       // End-of-file markers
+    TK_MORE,      // Rest of a lazily tokenized file
 } TokenKind;
 
+// Interned identifier. Every distinct spelling is stored in the
+// global atom table exactly once, so two names are equal if and
+// only if they have the same atom.
+typedef struct Atom Atom;
+struct Atom {
+    Atom *next;         // Next atom in the same hash bucket
+    char *name;         // NUL-terminated spelling
+    int len;            // Length of the spelling
+    unsigned int hash;  // Hash value of the spelling
+    bool is_keyword;    // True if the spelling is a C keyword
+};
+
+// Source file. Every buffer that is tokenized, including scratch
+// buffers created by the preprocessor, gets an entry in the file
+// table, and tokens refer to it by its index.
+typedef struct File File;
+struct File {
+    char *name;      // Input filename
+    int id;          // Index into the file table
+    int file_no;     // File number for .file and .loc directives
+    char *contents;  // Entire input string
+
+    // Offsets of the beginnings of lines in `contents`. This is built
+    // the first time a line number is requested. `line_delta` is added
+    // to line numbers computed from it.
+    int *line_starts;
+    int nlines;
+    int line_delta;
+};
+
+// State of a tokenizer that can be suspended and resumed, so that
+// a file can be tokenized as the preprocessor reads it.
+typedef struct {
+    File *file;
+    char *p;           // Next character to read
+    bool at_bol;
+    bool has_space;
+    bool in_directive;  // The current line is a preprocessing directive
+    int line_starts_capacity;
+} Lexer;
+
+// Value of a numeric or string literal. It is kept out of line
+// because most tokens are not literals.
+typedef struct {
+    Type *ty;        // Type of a numeric literal
+    long val;        // Integer value
+    double fval;     // Floating-point value
+    char *contents;  // String literal contents including terminating '\0'
+    int cont_len;    // String literal length
+} Literal;
+
 // Token type
 typedef struct Token Token;
 struct Token {
-    TokenKind kind;  // Token kind
-    Token *next;     // Next token
-    long val;        // If kind is TK_NUM, its value
-    double fval;     // If kind is TK_NUM, its value
-    Type *ty;        // Used if TK_NUM
-    char *loc;       // Token location
-    int len;         // Token length
-
-    char *contents;  // String literal contents including terminating '\0'
-    char cont_len;   // string literal length
-
-    char *filename;    // Input filename
-    char *input;       // Entire input string
-    int line_no;       // Line number
-    int file_no;       // File number for .loc directive
-    bool at_bol;       // True if this token is at beginning of line
-    bool has_space;    // True if this token follows a space character
-    Hideset *hideset;  // For macro expansion
+    Token *next;  // Next token
+    char *loc;    // Token location
+    union {
+        Atom *atom;    // Interned spelling if TK_IDENT or a keyword
+        Literal *lit;  // Value if TK_NUM or TK_STR
+        Lexer *lexer;  // Lexer to resume if TK_MORE
+    } u;
+    Hideset *hideset;     // For macro expansion
+    int len;              // Token length
+    int file_id;          // Index into the file table
+    TokenKind kind : 8;   // Token kind
+    bool at_bol : 1;      // True if this token is at beginning of line
+    bool has_space : 1;   // True if this token follows a space character
 };
 
+unsigned int hash_string(char *s, int len);
+Atom *intern2(char *name, int len, unsigned int hash);
+Atom *intern(char *name, int len);
 void error(char *fmt, ...);
 void error_tok(Token *tok, char *fmt, ...);
 void warn_tok(Token *tok, char *fmt, ...);
+int new_file_no(char *path);
+File *new_file(char *name, int file_no, char *contents);
+File *get_file(Token *tok);
+int get_line_no(Token *tok);
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *op);
 bool consume(Token **rest, Token *tok, char *str);
+bool pp_int_value(Token *tok, unsigned long *val, bool *is_unsigned);
+void convert_pp_number(Token *tok);
 void convert_pp_tokens(Token *tok);
-Token *tokenize(char *filename, int file_no, char *p);
+Token *tokenize(File *file);
+Token *lex_more(Lexer *lx);
+Token *skip_excluded_group(Token *tok);
+char *read_file(char *path, struct stat *st);
 Token *tokenize_file(char *filename);
 
+// Tokenizer statistics reported by -fstats
+typedef struct {
+    long files;   // Number of source files read
+    long bytes;   // Number of bytes scanned
+    long tokens;  // Number of tokens produced
+    long skipped; // Number of bytes skipped in excluded groups
+    long nsec;    // Time spent in tokenize()
+    long cache_hits;
+    long cache_misses;
+} TokenizeStats;
+
+extern TokenizeStats tokenize_stats;
+
+//
+// hashmap.c
+//
+
+typedef struct {
+    char *key;
+    int keylen;
+    unsigned int hash;
+    void *val;
+} HashEntry;
+
+typedef struct {
+    HashEntry *buckets;
+    int capacity;
+    int used;
+} HashMap;
+
+void *hashmap_get(HashMap *map, char *key);
+void *hashmap_get2(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, void *val);
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
+
+//
+// token_cache.c
+//
+
+Token *load_cached_tokens(File *file, struct stat *st);
+void store_cached_tokens(File *file, struct stat *st, Token *tok);
+
+//
+// prefetch.c
+//
+
+// Include prefetcher statistics reported by -fstats
+typedef struct {
+    long hits;    // Files that were read by a worker
+    long waits;   // Hits that had to wait for a worker
+    long misses;  // Files that were read by the main thread
+} PrefetchStats;
+
+extern PrefetchStats prefetch_stats;
+
+char *prefetched_include_path(char *filename, bool quoted);
+char *take_prefetched_file(char *path, struct stat *st);
+void prefetch_includes(char *path, char *contents, struct stat *st);
+
 //
 // preprocess.c
 //
 
+// #include resolution statistics reported by -fstats
+typedef struct {
+    long cache_hits;   // #includes resolved from the cache
+    long stats;        // stat() calls made to resolve #includes
+    long stats_saved;  // stat() calls avoided by the cache
+} IncludeStats;
+
+extern IncludeStats include_stats;
+
+// A file read by #include, for -M and -MD. Dependencies are listed in
+// the order in which files are first included, once per file.
+typedef struct Dependency Dependency;
+struct Dependency {
+    Dependency *next;
+    char *path;
+    bool is_system;  // Included with <...> or from a system header
+};
+
+extern Dependency *dependencies;
+
 void init_macros(void);
+void write_pch_macros(PchWriter *w, char *header);
+void read_pch_macros(Pch *pch);
 void define_macro(char *name, char *buf);
+void print_pp_stats(bool json);
 Token *preprocess(Token *tok);
+void preprocess_stream(Token *tok, void (*emit)(Token *tok, Token *origin),
+                       void (*enter_file)(Token *tok, int flag));
 
 //
 // parse.c
@@ -222,6 +400,8 @@ typedef struct {
 Node *new_cast(Node *expr, Type *ty);
 long const_expr(Token **rest, Token *tok);
 Program *parse(Token *tok);
+void write_pch_decls(PchWriter *w, Program *prog);
+void read_pch_decls(Pch *pch);
 
 //
 // typing.c
@@ -336,11 +516,54 @@ void add_type(Node *node);
 
 void codegen(Program *prog);
 
+//
+// pch.c
+//
+
+// Objects that a precompiled header is restored from
+typedef enum {
+    PCH_MACROS,        // NULL-terminated array of macros
+    PCH_FILE_INFOS,    // NULL-terminated array of guarded files
+    PCH_DEPENDENCIES,  // Dependency list
+    PCH_VAR_SCOPE,     // Parser scopes
+    PCH_TAG_SCOPE,
+    PCH_GLOBALS,
+    PCH_FUNCTIONS,
+    PCH_GVAR_COUNT,    // Number of anonymous globals, an int
+    PCH_NROOTS,
+} PchRoot;
+
+int pch_alloc(PchWriter *w, int size);
+int pch_copy(PchWriter *w, void *p, int size);
+void *pch_at(PchWriter *w, int off);
+void pch_ptr(PchWriter *w, int field, int ref);
+void pch_atom(PchWriter *w, int field, Atom *atom);
+int pch_string(PchWriter *w, char *s);
+int pch_list(PchWriter *w, void *head, int next_offset,
+             int (*write)(PchWriter *w, void *p));
+int pch_token(PchWriter *w, Token *tok);
+int pch_token_list(PchWriter *w, Token *tok);
+int pch_type(PchWriter *w, Type *ty);
+int pch_var(PchWriter *w, Var *var);
+int pch_var_list(PchWriter *w, Var *var);
+int pch_function_list(PchWriter *w, Function *fn);
+void pch_set_root(PchWriter *w, PchRoot root, int ref);
+void *pch_root(Pch *pch, PchRoot root);
+void write_pch(char *header, char *path, Program *prog);
+void load_pch(char *path);
+
 //
 // main.c
 //
 
 extern bool opt_E;
+extern bool opt_emit_pch;
 extern bool opt_fpic;
+extern bool opt_stats;
+extern bool opt_pp_stats;
+extern char *opt_token_cache;
+extern int opt_prefetch_threads;
+
+extern char **include_paths;
 
-extern char **include_paths;
\ No newline at end of file
+long now_nsec(void);
\ No newline at end of file
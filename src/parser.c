@@ -5,7 +5,7 @@
 typedef struct VarScope VarScope;
 struct VarScope {
     VarScope *next;
-    char *name;
+    Atom *name;
     int depth;
 
     Var *var;
@@ -18,7 +18,7 @@ struct VarScope {
 typedef struct TagScope TagScope;
 struct TagScope {
     TagScope *next;
-    char *name;
+    Atom *name;
     int depth;
     Type *ty;
 };
@@ -79,6 +79,12 @@ static TagScope *tag_scope;
 // by one at "}".
 static int scope_depth;
 
+// Number of anonymous global variables, which are named .L.data.<n>
+static int gvar_count;
+
+// Functions restored from a precompiled header
+static Function *pch_fns;
+
 // Points to the function object the parser is currently parsing.
 static Var *current_fn;
 
@@ -142,20 +148,20 @@ static void leave_scope(void) {
 // Find a variable or a typedef by name.
 static VarScope *find_var(Token *tok) {
     for (VarScope *sc = var_scope; sc; sc = sc->next)
-        if (strlen(sc->name) == tok->len && !strncmp(tok->loc, sc->name, tok->len))
+        if (sc->name == tok->u.atom)
             return sc;
     return NULL;
 }
 
 static TagScope *find_tag(Token *tok) {
     for (TagScope *sc = tag_scope; sc; sc = sc->next)
-        if (strlen(sc->name) == tok->len && !strncmp(tok->loc, sc->name, tok->len))
+        if (sc->name == tok->u.atom)
             return sc;
     return NULL;
 }
 
 static Node *new_node(NodeKind kind, Token *tok) {
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arena_alloc(&ast_arena, sizeof(Node));
     node->kind = kind;
     node->tok = tok;
     return node;
@@ -196,7 +202,7 @@ static Node *new_var_node(Var *var, Token *tok) {
 Node *new_cast(Node *expr, Type *ty) {
     add_type(expr);
 
-    Node *node = calloc(1, sizeof(Node));
+    Node *node = arena_alloc(&ast_arena, sizeof(Node));
     node->kind = ND_CAST;
     node->tok = expr->tok;
     node->lhs = expr;
@@ -205,27 +211,27 @@ Node *new_cast(Node *expr, Type *ty) {
 }
 
 static VarScope *push_scope(char *name) {
-    VarScope *sc = calloc(1, sizeof(VarScope));
+    VarScope *sc = arena_alloc(&ast_arena, sizeof(VarScope));
     sc->next = var_scope;
-    sc->name = name;
+    sc->name = intern(name, strlen(name));
     sc->depth = scope_depth;
     var_scope = sc;
     return sc;
 }
 
 static Initializer *new_init(Type *ty, int len, Node *expr, Token *tok) {
-    Initializer *init = calloc(1, sizeof(Initializer));
+    Initializer *init = arena_alloc(&ast_arena, sizeof(Initializer));
     init->ty = ty;
     init->tok = tok;
     init->len = len;
     init->expr = expr;
     if (len)
-        init->children = calloc(len, sizeof(Initializer *));
+        init->children = arena_alloc(&ast_arena, sizeof(Initializer *) * len);
     return init;
 }
 
 static Var *new_lvar(char *name, Type *ty) {
-    Var *var = calloc(1, sizeof(Var));
+    Var *var = arena_alloc(&ast_arena, sizeof(Var));
     var->name = name;
     var->ty = ty;
     var->align = ty->align;
@@ -237,7 +243,7 @@ static Var *new_lvar(char *name, Type *ty) {
 }
 
 static Var *new_gvar(char *name, Type *ty, bool is_static, bool emit) {
-    Var *var = calloc(1, sizeof(Var));
+    Var *var = arena_alloc(&ast_arena, sizeof(Var));
     var->name = name;
     var->ty = ty;
     var->align = ty->align;
@@ -252,9 +258,8 @@ static Var *new_gvar(char *name, Type *ty, bool is_static, bool emit) {
 }
 
 static char *new_gvar_name(void) {
-    static int cnt = 0;
-    char *buf = malloc(20);
-    sprintf(buf, ".L.data.%d", cnt++);
+    char *buf = arena_alloc(&ast_arena, 20);
+    sprintf(buf, ".L.data.%d", gvar_count++);
     return buf;
 }
 
@@ -268,7 +273,7 @@ static Var *new_string_literal(char *p, int len) {
 static char *get_ident(Token *tok) {
     if (tok->kind != TK_IDENT)
         error_tok(tok, "expected an identifier");
-    return strndup(tok->loc, tok->len);
+    return tok->u.atom->name;
 }
 
 static Type *find_typedef(Token *tok) {
@@ -281,15 +286,17 @@ static Type *find_typedef(Token *tok) {
 }
 
 static long get_number(Token *tok) {
+    if (tok->kind == TK_PP_NUM)
+        convert_pp_number(tok);
     if (tok->kind != TK_NUM)
         error_tok(tok, "expected a number");
-    return tok->val;
+    return tok->u.lit->val;
 }
 
 static void push_tag_scope(Token *tok, Type *ty) {
-    TagScope *sc = calloc(1, sizeof(TagScope));
+    TagScope *sc = arena_alloc(&ast_arena, sizeof(TagScope));
     sc->next = tag_scope;
-    sc->name = strndup(tok->loc, tok->len);
+    sc->name = tok->u.atom;
     sc->depth = scope_depth;
     sc->ty = ty;
     tag_scope = sc;
@@ -313,7 +320,7 @@ static Function *funcdef(Token **rest, Token *tok) {
     if (!ty->name)
         error_tok(ty->name_pos, "function name omitted");
 
-    Function *fn = calloc(1, sizeof(Function));
+    Function *fn = arena_alloc(&ast_arena, sizeof(Function));
     fn->name = get_ident(ty->name);
     fn->is_static = attr.is_static;
     fn->is_variadic = ty->is_variadic;
@@ -629,7 +636,7 @@ static Type *declarator(Token **rest, Token *tok, Type *ty) {
     ty = pointers(&tok, tok, ty);
 
     if (equal(tok, "(")) {
-        Type *placeholder = calloc(1, sizeof(Type));
+        Type *placeholder = arena_alloc(&type_arena, sizeof(Type));
         Type *new_ty = declarator(&tok, tok->next, placeholder);
         tok = skip(tok, ")");
         *placeholder = *type_suffix(rest, tok, ty);
@@ -655,7 +662,7 @@ static Type *abstract_declarator(Token **rest, Token *tok, Type *ty) {
     ty = pointers(&tok, tok, ty);
 
     if (equal(tok, "(")) {
-        Type *placeholder = calloc(1, sizeof(Type));
+        Type *placeholder = arena_alloc(&type_arena, sizeof(Type));
         Type *new_ty = abstract_declarator(&tok, tok->next, placeholder);
         tok = skip(tok, ")");
         *placeholder = *type_suffix(rest, tok, ty);
@@ -810,19 +817,19 @@ static Token *skip_end(Token *tok) {
 static Initializer *string_initializer(Token **rest, Token *tok, Type *ty) {
     // Initialize a char array with a string literal.
     if (ty->is_incomplete) {
-        ty->size = tok->cont_len;
-        ty->array_len = tok->cont_len;
+        ty->size = tok->u.lit->cont_len;
+        ty->array_len = tok->u.lit->cont_len;
         ty->is_incomplete = false;
     }
 
     Initializer *init = new_init(ty, ty->array_len, NULL, tok);
 
-    int len = (ty->array_len < tok->cont_len)
+    int len = (ty->array_len < tok->u.lit->cont_len)
                   ? ty->array_len
-                  : tok->cont_len;
+                  : tok->u.lit->cont_len;
 
     for (int i = 0; i < len; i++) {
-        Node *expr = new_num(tok->contents[i], tok);
+        Node *expr = new_num(tok->u.lit->contents[i], tok);
         init->children[i] = new_init(ty->base, 0, expr, tok);
     }
     *rest = tok->next;
@@ -1058,7 +1065,7 @@ write_gvar_data(Relocation *cur, Initializer *init, Type *ty, char *buf, int off
     long val = eval2(init->expr, &var);
 
     if (var) {
-        Relocation *rel = calloc(1, sizeof(Relocation));
+        Relocation *rel = arena_alloc(&ast_arena, sizeof(Relocation));
         rel->offset = offset;
         rel->label = var->name;
         rel->addend = val;
@@ -1078,7 +1085,7 @@ static void gvar_initializer(Token **rest, Token *tok, Var *var) {
     Initializer *init = initializer(rest, tok, var->ty);
 
     Relocation head = {};
-    char *buf = calloc(1, size_of(var->ty));
+    char *buf = arena_alloc(&ast_arena, size_of(var->ty));
     write_gvar_data(&head, init, var->ty, buf, 0);
     var->init_data = buf;
     var->rel = head.next;
@@ -1265,7 +1272,7 @@ static Node *stmt(Token **rest, Token *tok) {
 
     if (tok->kind == TK_IDENT && equal(tok->next, ":")) {
         Node *node = new_node(ND_LABEL, tok);
-        node->label_name = strndup(tok->loc, tok->len);
+        node->label_name = arena_strndup(&ast_arena, tok->loc, tok->len);
         node->lhs = stmt(rest, tok->next->next);
         return node;
     }
@@ -1856,7 +1863,7 @@ static Member *struct_members(Token **rest, Token *tok) {
             if (cnt++)
                 tok = skip(tok, ",");
 
-            Member *mem = calloc(1, sizeof(Member));
+            Member *mem = arena_alloc(&type_arena, sizeof(Member));
             mem->ty = declarator(&tok, tok, basety);
             mem->name = mem->ty->name;
             mem->align = attr.align ? attr.align : mem->ty->align;
@@ -1977,8 +1984,7 @@ static Type *union_decl(Token **rest, Token *tok) {
 
 static Member *get_struct_member(Type *ty, Token *tok) {
     for (Member *mem = ty->members; mem; mem = mem->next)
-        if (mem->name->len == tok->len &&
-            !strncmp(mem->name->loc, tok->loc, tok->len))
+        if (mem->name->u.atom == tok->u.atom)
             return mem;
     error_tok(tok, "no such member");
 }
@@ -2186,7 +2192,7 @@ static Node *primary(Token **rest, Token *tok) {
 
         if (equal(tok->next, "(")) {
             warn_tok(tok, "implicit declaration of a function");
-            char *name = strndup(tok->loc, tok->len);
+            char *name = arena_strndup(&ast_arena, tok->loc, tok->len);
             Var *var = new_gvar(name, func_type(ty_int), true, false);
             return new_var_node(var, tok);
         }
@@ -2195,24 +2201,26 @@ static Node *primary(Token **rest, Token *tok) {
     }
 
     if (tok->kind == TK_STR) {
-        Var *var = new_string_literal(tok->contents, tok->cont_len);
+        Var *var = new_string_literal(tok->u.lit->contents, tok->u.lit->cont_len);
         *rest = tok->next;
         return new_var_node(var, tok);
     }
 
+    if (tok->kind == TK_PP_NUM)
+        convert_pp_number(tok);
     if (tok->kind != TK_NUM)
         error_tok(tok, "expected expression");
 
     Node *node;
 
-    if (is_flonum(tok->ty)) {
+    if (is_flonum(tok->u.lit->ty)) {
         node = new_node(ND_NUM, tok);
-        node->fval = tok->fval;
+        node->fval = tok->u.lit->fval;
     } else {
-        node = new_num(tok->val, tok);
+        node = new_num(tok->u.lit->val, tok);
     }
 
-    node->ty = tok->ty;
+    node->ty = tok->u.lit->ty;
     *rest = tok->next;
     return node;
 }
@@ -2222,10 +2230,13 @@ Program *parse(Token *tok) {
     // Add built-in function types.
     new_gvar("__builtin_va_start", func_type(ty_void), true, false);
 
-    // Read source code until EOF.
+    // Read source code until EOF. Functions from a precompiled
+    // header come first.
     Function head = {};
+    head.next = pch_fns;
     Function *cur = &head;
-    globals = NULL;
+    while (cur->next)
+        cur = cur->next;
 
     while (tok->kind != TK_EOF) {
         Token *start = tok;
@@ -2277,8 +2288,48 @@ Program *parse(Token *tok) {
         }
     }
 
-    Program *prog = calloc(1, sizeof(Program));
+    Program *prog = arena_alloc(&ast_arena, sizeof(Program));
     prog->globals = globals;
     prog->fns = head.next;
     return prog;
-}
\ No newline at end of file
+}
+
+static int write_var_scope(PchWriter *w, void *p) {
+    VarScope *sc = p;
+    int off = pch_copy(w, sc, sizeof(VarScope));
+    pch_atom(w, off + offsetof(VarScope, name), sc->name);
+    pch_ptr(w, off + offsetof(VarScope, var), pch_var(w, sc->var));
+    pch_ptr(w, off + offsetof(VarScope, type_def), pch_type(w, sc->type_def));
+    pch_ptr(w, off + offsetof(VarScope, enum_ty), pch_type(w, sc->enum_ty));
+    return off;
+}
+
+static int write_tag_scope(PchWriter *w, void *p) {
+    TagScope *sc = p;
+    int off = pch_copy(w, sc, sizeof(TagScope));
+    pch_atom(w, off + offsetof(TagScope, name), sc->name);
+    pch_ptr(w, off + offsetof(TagScope, ty), pch_type(w, sc->ty));
+    return off;
+}
+
+// Writes the file scope, the global variables and the functions of a
+// parsed header to a precompiled header.
+void write_pch_decls(PchWriter *w, Program *prog) {
+    pch_set_root(w, PCH_VAR_SCOPE,
+                 pch_list(w, var_scope, offsetof(VarScope, next), write_var_scope));
+    pch_set_root(w, PCH_TAG_SCOPE,
+                 pch_list(w, tag_scope, offsetof(TagScope, next), write_tag_scope));
+    pch_set_root(w, PCH_GLOBALS, pch_var_list(w, prog->globals));
+    pch_set_root(w, PCH_FUNCTIONS, pch_function_list(w, prog->fns));
+    pch_set_root(w, PCH_GVAR_COUNT, pch_copy(w, &gvar_count, sizeof(gvar_count)));
+}
+
+// Restores the state written by write_pch_decls, so that parse()
+// continues from it.
+void read_pch_decls(Pch *pch) {
+    var_scope = pch_root(pch, PCH_VAR_SCOPE);
+    tag_scope = pch_root(pch, PCH_TAG_SCOPE);
+    globals = pch_root(pch, PCH_GLOBALS);
+    pch_fns = pch_root(pch, PCH_FUNCTIONS);
+    gvar_count = *(int *)pch_root(pch, PCH_GVAR_COUNT);
+}
@@ -0,0 +1,646 @@
+#include "nsc.h"
+
+// A precompiled header is a snapshot of the compiler state after a
+// header has been read: the macro table and the include guards of the
+// preprocessor, and the scopes, global variables and functions of the
+// parser. `--emit-pch prefix.h -o prefix.pch` writes one, and
+// `-include-pch prefix.pch` restores it before the main file is read,
+// which has the same effect as including prefix.h first.
+//
+// The file is an image of the objects that make up the state, laid
+// out as they are in memory, so loading it is a matter of mapping it
+// and fixing up its pointers. A pointer in the image holds an offset
+// from the beginning of the image, and a relocation table lists every
+// field that needs fixing up:
+//
+//  - RELOC_PTR: a pointer into the image, or to a builtin type if the
+//    offset is negative.
+//  - RELOC_ATOM: an index into the atom table. Atoms are interned when
+//    loading, so that they are the same as those of the main file.
+//  - RELOC_FILE_ID: an index into the file table. The files tokens
+//    refer to are added to the file table when loading and are given
+//    new file numbers.
+//
+// Each module writes its own objects with the pch_* functions. An
+// object is copied as is and then its pointer fields are overwritten
+// with references to the objects they point to. Objects that can be
+// reached in more than one way are written once.
+
+#define PCH_MAGIC "nscpch1"
+
+struct Pch {
+    char magic[8];
+    int layout;   // Sizes of the structs in the image
+    int size;     // Size of the image including this header
+    int relocs;   // Offset of the relocation table
+    int nrelocs;
+    int atoms;    // Offset of the atom table
+    int natoms;
+    int files;    // Offset of the file table
+    int nfiles;
+    long roots[PCH_NROOTS];
+};
+
+typedef enum {
+    RELOC_PTR,
+    RELOC_ATOM,
+    RELOC_FILE_ID,
+} RelocKind;
+
+typedef struct {
+    int offset;
+    RelocKind kind;
+} PchReloc;
+
+typedef struct {
+    int name;  // Offset of the spelling
+    int len;
+} PchAtom;
+
+typedef struct {
+    int name;
+    int contents;
+    int line_starts;
+    int nlines;
+    int line_delta;
+} PchFile;
+
+// Maps the addresses of objects to positive numbers. It is an
+// open-addressing hash table like HashMap, keyed by pointers.
+typedef struct {
+    void **keys;
+    int *vals;
+    int capacity;
+    int used;
+} PtrMap;
+
+// A file in the file table of an image being written
+typedef struct {
+    File *file;
+    int contents;  // Offset of the contents in the image
+    int len;       // Length of the contents
+} FileRef;
+
+struct PchWriter {
+    char *buf;
+    int len;
+    int cap;
+
+    PtrMap objs;   // Object -> offset
+    PtrMap atoms;  // Atom -> index + 1
+    PtrMap files;  // File -> index + 1
+
+    Atom **atom_list;
+    int natoms;
+    int atoms_cap;
+
+    FileRef *file_list;
+    int nfiles;
+    int files_cap;
+
+    PchReloc *relocs;
+    int nrelocs;
+    int relocs_cap;
+};
+
+// Builtin types are not written to the image. A pointer to the i'th
+// type is written as -i-1.
+static Type **builtin_types[] = {
+    &ty_void, &ty_bool, &ty_char, &ty_short, &ty_int, &ty_long,
+    &ty_schar, &ty_sshort, &ty_sint, &ty_slong, &ty_uchar, &ty_ushort,
+    &ty_uint, &ty_ulong, &ty_float, &ty_double,
+};
+
+// An image can only be loaded by a compiler with the same layouts.
+static int layout(void) {
+    return sizeof(Token) + sizeof(Literal) * 3 + sizeof(Type) * 5 +
+           sizeof(Member) * 7 + sizeof(Var) * 11 + sizeof(Relocation) * 13 +
+           sizeof(Node) * 17 + sizeof(Function) * 19;
+}
+
+static unsigned int hash_ptr(void *p) {
+    unsigned long x = (unsigned long)p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdUL;
+    x ^= x >> 33;
+    return x;
+}
+
+static int map_get(PtrMap *map, void *key) {
+    if (!map->keys)
+        return 0;
+
+    int mask = map->capacity - 1;
+    for (int i = hash_ptr(key) & mask; map->keys[i]; i = (i + 1) & mask)
+        if (map->keys[i] == key)
+            return map->vals[i];
+    return 0;
+}
+
+static void map_put(PtrMap *map, void *key, int val);
+
+static void map_grow(PtrMap *map) {
+    PtrMap map2 = {};
+    map2.capacity = map->capacity ? map->capacity * 2 : 1024;
+    map2.keys = calloc(map2.capacity, sizeof(void *));
+    map2.vals = calloc(map2.capacity, sizeof(int));
+
+    for (int i = 0; i < map->capacity; i++)
+        if (map->keys[i])
+            map_put(&map2, map->keys[i], map->vals[i]);
+
+    free(map->keys);
+    free(map->vals);
+    *map = map2;
+}
+
+// Adds a key that is not in the map.
+static void map_put(PtrMap *map, void *key, int val) {
+    if ((map->used + 1) * 2 > map->capacity)
+        map_grow(map);
+
+    int mask = map->capacity - 1;
+    int i = hash_ptr(key) & mask;
+    while (map->keys[i])
+        i = (i + 1) & mask;
+    map->keys[i] = key;
+    map->vals[i] = val;
+    map->used++;
+}
+
+static void map_free(PtrMap *map) {
+    free(map->keys);
+    free(map->vals);
+}
+
+//
+// Writer
+//
+
+// Allocates zero-filled space in the image and returns its offset.
+// The space is 8-byte aligned. Offsets stay valid as the image grows,
+// but pointers returned by pch_at do not.
+int pch_alloc(PchWriter *w, int size) {
+    int off = w->len;
+    int len = off + align_to(size, 8);
+    if (len > w->cap) {
+        while (len > w->cap)
+            w->cap *= 2;
+        w->buf = realloc(w->buf, w->cap);
+    }
+    memset(w->buf + off, 0, len - off);
+    w->len = len;
+    return off;
+}
+
+// Copies an object to the image. Its pointer fields must then be
+// overwritten by the caller.
+int pch_copy(PchWriter *w, void *p, int size) {
+    int off = pch_alloc(w, size);
+    memcpy(w->buf + off, p, size);
+    return off;
+}
+
+void *pch_at(PchWriter *w, int off) {
+    return w->buf + off;
+}
+
+static void add_reloc(PchWriter *w, int field, RelocKind kind) {
+    if (w->nrelocs == w->relocs_cap) {
+        w->relocs_cap = w->relocs_cap ? w->relocs_cap * 2 : 4096;
+        w->relocs = realloc(w->relocs, sizeof(PchReloc) * w->relocs_cap);
+    }
+    w->relocs[w->nrelocs++] = (PchReloc){field, kind};
+}
+
+// Sets the pointer field at `field` to the object written at `ref`.
+// A reference of 0 is a null pointer.
+void pch_ptr(PchWriter *w, int field, int ref) {
+    *(long *)(w->buf + field) = ref;
+    if (ref)
+        add_reloc(w, field, RELOC_PTR);
+}
+
+// Sets the atom field at `field`.
+void pch_atom(PchWriter *w, int field, Atom *atom) {
+    if (!atom) {
+        pch_ptr(w, field, 0);
+        return;
+    }
+
+    int idx = map_get(&w->atoms, atom);
+    if (!idx) {
+        if (w->natoms == w->atoms_cap) {
+            w->atoms_cap = w->atoms_cap ? w->atoms_cap * 2 : 1024;
+            w->atom_list = realloc(w->atom_list, sizeof(Atom *) * w->atoms_cap);
+        }
+        w->atom_list[w->natoms] = atom;
+        idx = ++w->natoms;
+        map_put(&w->atoms, atom, idx);
+    }
+    *(long *)(w->buf + field) = idx - 1;
+    add_reloc(w, field, RELOC_ATOM);
+}
+
+// Writes `len` bytes once per address.
+static int pch_bytes(PchWriter *w, void *p, int len) {
+    if (!p)
+        return 0;
+    int off = map_get(&w->objs, p);
+    if (!off) {
+        off = pch_copy(w, p, len);
+        map_put(&w->objs, p, off);
+    }
+    return off;
+}
+
+int pch_string(PchWriter *w, char *s) {
+    return s ? pch_bytes(w, s, strlen(s) + 1) : 0;
+}
+
+// Writes a linked list whose elements have their next pointer at
+// `next_offset`, using `write` for each element, and links the copies.
+// Lists may share a tail (copy_type shares `members`, for example), so
+// a link that is already in place is left alone rather than relocated
+// a second time. Returns the reference to the first element.
+int pch_list(PchWriter *w, void *head, int next_offset,
+             int (*write)(PchWriter *w, void *p)) {
+    int first = 0;
+    int prev = 0;
+    for (char *p = head; p; p = *(char **)(p + next_offset)) {
+        int off = write(w, p);
+        if (prev && *(long *)(w->buf + prev + next_offset) != off)
+            pch_ptr(w, prev + next_offset, off);
+        else if (!prev)
+            first = off;
+        prev = off;
+    }
+    if (prev)
+        pch_ptr(w, prev + next_offset, 0);
+    return first;
+}
+
+// Returns the index of a file in the file table of the image.
+static int pch_file(PchWriter *w, File *file) {
+    int idx = map_get(&w->files, file);
+    if (idx)
+        return idx - 1;
+
+    if (w->nfiles == w->files_cap) {
+        w->files_cap = w->files_cap ? w->files_cap * 2 : 256;
+        w->file_list = realloc(w->file_list, sizeof(FileRef) * w->files_cap);
+    }
+    FileRef *ref = &w->file_list[w->nfiles];
+    ref->file = file;
+    ref->len = strlen(file->contents);
+    ref->contents = pch_bytes(w, file->contents, ref->len + 1);
+    map_put(&w->files, file, ++w->nfiles);
+    return w->nfiles - 1;
+}
+
+static int pch_literal(PchWriter *w, Literal *lit) {
+    int off = pch_copy(w, lit, sizeof(Literal));
+    pch_ptr(w, off + offsetof(Literal, ty), pch_type(w, lit->ty));
+    pch_ptr(w, off + offsetof(Literal, contents), pch_bytes(w, lit->contents, lit->cont_len));
+    return off;
+}
+
+// Writes a token without the token that follows it.
+int pch_token(PchWriter *w, Token *tok) {
+    if (!tok)
+        return 0;
+    int off = map_get(&w->objs, tok);
+    if (off)
+        return off;
+
+    off = pch_copy(w, tok, sizeof(Token));
+    map_put(&w->objs, tok, off);
+    pch_ptr(w, off + offsetof(Token, next), 0);
+    pch_ptr(w, off + offsetof(Token, hideset), 0);
+
+    // The location is an offset into the contents of the file.
+    int idx = pch_file(w, get_file(tok));
+    FileRef *ref = &w->file_list[idx];
+    int pos = tok->loc - ref->file->contents;
+    if (0 <= pos && pos + tok->len <= ref->len)
+        pch_ptr(w, off + offsetof(Token, loc), ref->contents + pos);
+    else
+        pch_ptr(w, off + offsetof(Token, loc), pch_bytes(w, tok->loc, tok->len));
+
+    *(int *)(w->buf + off + offsetof(Token, file_id)) = idx;
+    add_reloc(w, off + offsetof(Token, file_id), RELOC_FILE_ID);
+
+    switch (tok->kind) {
+        case TK_IDENT:
+        case TK_RESERVED:
+            pch_atom(w, off + offsetof(Token, u.atom), tok->u.atom);
+            break;
+        case TK_NUM:
+        case TK_STR:
+            pch_ptr(w, off + offsetof(Token, u.lit), pch_literal(w, tok->u.lit));
+            break;
+        default:
+            pch_ptr(w, off + offsetof(Token, u.atom), 0);
+    }
+    return off;
+}
+
+static int write_token(PchWriter *w, void *p) {
+    return pch_token(w, p);
+}
+
+int pch_token_list(PchWriter *w, Token *tok) {
+    return pch_list(w, tok, offsetof(Token, next), write_token);
+}
+
+static int write_member(PchWriter *w, void *p) {
+    Member *mem = p;
+    int off = map_get(&w->objs, mem);
+    if (off)
+        return off;
+
+    off = pch_copy(w, mem, sizeof(Member));
+    map_put(&w->objs, mem, off);
+    pch_ptr(w, off + offsetof(Member, next), 0);
+    pch_ptr(w, off + offsetof(Member, ty), pch_type(w, mem->ty));
+    pch_ptr(w, off + offsetof(Member, tok), pch_token(w, mem->tok));
+    pch_ptr(w, off + offsetof(Member, name), pch_token(w, mem->name));
+    return off;
+}
+
+int pch_type(PchWriter *w, Type *ty) {
+    if (!ty)
+        return 0;
+    for (int i = 0; i < sizeof(builtin_types) / sizeof(*builtin_types); i++)
+        if (ty == *builtin_types[i])
+            return -i - 1;
+
+    int off = map_get(&w->objs, ty);
+    if (off)
+        return off;
+
+    off = pch_copy(w, ty, sizeof(Type));
+    map_put(&w->objs, ty, off);
+    pch_ptr(w, off + offsetof(Type, base), pch_type(w, ty->base));
+    pch_ptr(w, off + offsetof(Type, name), pch_token(w, ty->name));
+    pch_ptr(w, off + offsetof(Type, name_pos), pch_token(w, ty->name_pos));
+    pch_ptr(w, off + offsetof(Type, members),
+            pch_list(w, ty->members, offsetof(Member, next), write_member));
+    pch_ptr(w, off + offsetof(Type, return_ty), pch_type(w, ty->return_ty));
+    pch_ptr(w, off + offsetof(Type, params), pch_type(w, ty->params));
+    pch_ptr(w, off + offsetof(Type, next), pch_type(w, ty->next));
+    return off;
+}
+
+static int write_relocation(PchWriter *w, void *p) {
+    Relocation *rel = p;
+    int off = pch_copy(w, rel, sizeof(Relocation));
+    pch_ptr(w, off + offsetof(Relocation, label), pch_string(w, rel->label));
+    return off;
+}
+
+// Writes a variable. Its next pointer is set by pch_var_list.
+int pch_var(PchWriter *w, Var *var) {
+    if (!var)
+        return 0;
+    int off = map_get(&w->objs, var);
+    if (off)
+        return off;
+
+    off = pch_copy(w, var, sizeof(Var));
+    map_put(&w->objs, var, off);
+    pch_ptr(w, off + offsetof(Var, next), 0);
+    pch_ptr(w, off + offsetof(Var, name), pch_string(w, var->name));
+    pch_ptr(w, off + offsetof(Var, ty), pch_type(w, var->ty));
+    pch_ptr(w, off + offsetof(Var, tok), pch_token(w, var->tok));
+    pch_ptr(w, off + offsetof(Var, init_data),
+            pch_bytes(w, var->init_data, size_of(var->ty)));
+    pch_ptr(w, off + offsetof(Var, rel),
+            pch_list(w, var->rel, offsetof(Relocation, next), write_relocation));
+    return off;
+}
+
+static int write_var(PchWriter *w, void *p) {
+    return pch_var(w, p);
+}
+
+int pch_var_list(PchWriter *w, Var *var) {
+    return pch_list(w, var, offsetof(Var, next), write_var);
+}
+
+static int pch_node(PchWriter *w, Node *node) {
+    if (!node)
+        return 0;
+    int off = map_get(&w->objs, node);
+    if (off)
+        return off;
+
+    off = pch_copy(w, node, sizeof(Node));
+    map_put(&w->objs, node, off);
+    pch_ptr(w, off + offsetof(Node, next), pch_node(w, node->next));
+    pch_ptr(w, off + offsetof(Node, ty), pch_type(w, node->ty));
+    pch_ptr(w, off + offsetof(Node, tok), pch_token(w, node->tok));
+    pch_ptr(w, off + offsetof(Node, lhs), pch_node(w, node->lhs));
+    pch_ptr(w, off + offsetof(Node, rhs), pch_node(w, node->rhs));
+    pch_ptr(w, off + offsetof(Node, cond), pch_node(w, node->cond));
+    pch_ptr(w, off + offsetof(Node, then), pch_node(w, node->then));
+    pch_ptr(w, off + offsetof(Node, els), pch_node(w, node->els));
+    pch_ptr(w, off + offsetof(Node, init), pch_node(w, node->init));
+    pch_ptr(w, off + offsetof(Node, inc), pch_node(w, node->inc));
+    pch_ptr(w, off + offsetof(Node, body), pch_node(w, node->body));
+    pch_ptr(w, off + offsetof(Node, member), node->member ? write_member(w, node->member) : 0);
+    pch_ptr(w, off + offsetof(Node, func_ty), pch_type(w, node->func_ty));
+    pch_ptr(w, off + offsetof(Node, label_name), pch_string(w, node->label_name));
+    pch_ptr(w, off + offsetof(Node, case_next), pch_node(w, node->case_next));
+    pch_ptr(w, off + offsetof(Node, default_case), pch_node(w, node->default_case));
+    pch_ptr(w, off + offsetof(Node, var), pch_var(w, node->var));
+
+    int args = 0;
+    if (node->args) {
+        args = pch_alloc(w, sizeof(Var *) * node->nargs);
+        for (int i = 0; i < node->nargs; i++)
+            pch_ptr(w, args + sizeof(Var *) * i, pch_var(w, node->args[i]));
+    }
+    pch_ptr(w, off + offsetof(Node, args), args);
+    return off;
+}
+
+static int write_function(PchWriter *w, void *p) {
+    Function *fn = p;
+    int off = pch_copy(w, fn, sizeof(Function));
+    pch_ptr(w, off + offsetof(Function, name), pch_string(w, fn->name));
+    // The parameters are the tail of the locals.
+    pch_ptr(w, off + offsetof(Function, locals), pch_var_list(w, fn->locals));
+    pch_ptr(w, off + offsetof(Function, params), pch_var(w, fn->params));
+    pch_ptr(w, off + offsetof(Function, node), pch_node(w, fn->node));
+    return off;
+}
+
+int pch_function_list(PchWriter *w, Function *fn) {
+    return pch_list(w, fn, offsetof(Function, next), write_function);
+}
+
+void pch_set_root(PchWriter *w, PchRoot root, int ref) {
+    pch_ptr(w, offsetof(Pch, roots) + sizeof(long) * root, ref);
+}
+
+// Writes a precompiled header of the state after `header` has been
+// parsed into `prog`. The image is written to a temporary file first
+// and then renamed, like a token cache entry.
+void write_pch(char *header, char *path, Program *prog) {
+    PchWriter *w = calloc(1, sizeof(PchWriter));
+    w->cap = 1 << 20;
+    w->buf = malloc(w->cap);
+    pch_alloc(w, sizeof(Pch));
+
+    write_pch_macros(w, header);
+    write_pch_decls(w, prog);
+
+    // The file table. Line-start indices are written here because
+    // a file is lexed to the end only after its first token was written.
+    int files = pch_alloc(w, sizeof(PchFile) * w->nfiles);
+    for (int i = 0; i < w->nfiles; i++) {
+        File *file = w->file_list[i].file;
+        int name = pch_string(w, file->name);
+        int line_starts = pch_bytes(w, file->line_starts, sizeof(int) * file->nlines);
+        PchFile *pf = pch_at(w, files + sizeof(PchFile) * i);
+        pf->name = name;
+        pf->contents = w->file_list[i].contents;
+        pf->line_starts = line_starts;
+        pf->nlines = file->nlines;
+        pf->line_delta = file->line_delta;
+    }
+
+    int atoms = pch_alloc(w, sizeof(PchAtom) * w->natoms);
+    for (int i = 0; i < w->natoms; i++) {
+        Atom *atom = w->atom_list[i];
+        int name = pch_bytes(w, atom->name, atom->len + 1);
+        PchAtom *pa = pch_at(w, atoms + sizeof(PchAtom) * i);
+        pa->name = name;
+        pa->len = atom->len;
+    }
+
+    // The relocation table comes last since every other part of the
+    // image adds to it.
+    int nrelocs = w->nrelocs;
+    int relocs = pch_copy(w, w->relocs, sizeof(PchReloc) * nrelocs);
+
+    Pch *pch = pch_at(w, 0);
+    memcpy(pch->magic, PCH_MAGIC, sizeof(pch->magic));
+    pch->layout = layout();
+    pch->size = w->len;
+    pch->relocs = relocs;
+    pch->nrelocs = nrelocs;
+    pch->atoms = atoms;
+    pch->natoms = w->natoms;
+    pch->files = files;
+    pch->nfiles = w->nfiles;
+
+    char *tmp = malloc(strlen(path) + 20);
+    sprintf(tmp, "%s.%d", path, getpid());
+    FILE *fp = fopen(tmp, "w");
+    if (!fp)
+        error("cannot open output file %s: %s", tmp, strerror(errno));
+    fwrite(w->buf, 1, w->len, fp);
+    if (fclose(fp)) {
+        unlink(tmp);
+        error("cannot write %s: %s", path, strerror(errno));
+    }
+    if (rename(tmp, path)) {
+        unlink(tmp);
+        error("cannot write %s: %s", path, strerror(errno));
+    }
+
+    map_free(&w->objs);
+    map_free(&w->atoms);
+    map_free(&w->files);
+    free(w->atom_list);
+    free(w->file_list);
+    free(w->relocs);
+    free(w->buf);
+    free(w);
+    free(tmp);
+}
+
+//
+// Loader
+//
+
+void *pch_root(Pch *pch, PchRoot root) {
+    return (void *)pch->roots[root];
+}
+
+// Maps a precompiled header and restores the state it holds.
+void load_pch(char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        error("cannot open %s: %s", path, strerror(errno));
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        error("%s: %s", path, strerror(errno));
+    if (st.st_size < sizeof(Pch))
+        error("%s: not a precompiled header", path);
+
+    // Pages are copied only when relocations write to them.
+    char *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        error("%s: %s", path, strerror(errno));
+
+    Pch *pch = (Pch *)base;
+    if (memcmp(pch->magic, PCH_MAGIC, sizeof(pch->magic)) || pch->size != st.st_size)
+        error("%s: not a precompiled header", path);
+    if (pch->layout != layout())
+        error("%s: precompiled header was written by a different compiler", path);
+
+    Atom **atoms = malloc(sizeof(Atom *) * pch->natoms);
+    PchAtom *pa = (PchAtom *)(base + pch->atoms);
+    for (int i = 0; i < pch->natoms; i++)
+        atoms[i] = intern(base + pa[i].name, pa[i].len);
+
+    // Scratch buffers share the name of the file they were made from,
+    // so files are given one new file number per name.
+    int *ids = malloc(sizeof(int) * pch->nfiles);
+    HashMap file_nos = {};
+    PchFile *pf = (PchFile *)(base + pch->files);
+    for (int i = 0; i < pch->nfiles; i++) {
+        char *name = base + pf[i].name;
+        long file_no = (long)hashmap_get(&file_nos, name);
+        if (!file_no) {
+            file_no = new_file_no(name);
+            hashmap_put(&file_nos, name, (void *)file_no);
+        }
+
+        File *file = new_file(name, file_no, base + pf[i].contents);
+        if (pf[i].line_starts)
+            file->line_starts = (int *)(base + pf[i].line_starts);
+        file->nlines = pf[i].nlines;
+        file->line_delta = pf[i].line_delta;
+        ids[i] = file->id;
+    }
+    free(file_nos.buckets);
+
+    PchReloc *relocs = (PchReloc *)(base + pch->relocs);
+    for (int i = 0; i < pch->nrelocs; i++) {
+        char *field = base + relocs[i].offset;
+        switch (relocs[i].kind) {
+            case RELOC_PTR: {
+                long ref = *(long *)field;
+                *(void **)field = (ref > 0) ? (void *)(base + ref) : *builtin_types[-ref - 1];
+                break;
+            }
+            case RELOC_ATOM:
+                *(Atom **)field = atoms[*(long *)field];
+                break;
+            case RELOC_FILE_ID:
+                *(int *)field = ids[*(int *)field];
+                break;
+        }
+    }
+    free(atoms);
+    free(ids);
+
+    read_pch_macros(pch);
+    read_pch_decls(pch);
+}
@@ -0,0 +1,280 @@
+#include "nsc.h"
+#include <pthread.h>
+
+// The include prefetcher reads headers on a small pool of worker
+// threads before the preprocessor needs them. It is enabled by
+// -fprefetch-includes.
+//
+// Every file read by tokenize_file is handed to the prefetcher, which
+// scans its text for #include directives, resolves their filenames
+// against the include paths and reads the resulting files. Files read
+// this way are scanned in turn, so the workers run ahead of the
+// preprocessor through the whole include tree. The scan is purely
+// textual: directives in comments or in skipped #if groups are also
+// followed, and computed includes (#include FOO) are not. Neither
+// mistake affects the output; it only costs or saves some I/O.
+//
+// Workers only resolve paths and read file contents. Tokenization
+// stays on the main thread because the atom table, the file table and
+// the arenas are not thread-safe. Workers therefore allocate with
+// malloc only.
+
+typedef enum {
+    PF_QUEUED,   // Waiting for a worker
+    PF_RUNNING,  // A worker is reading or scanning the file
+    PF_DONE,     // Scanned
+    PF_FAILED,   // The file could not be read
+    PF_MAIN,     // The main thread is reading the file itself
+} PrefetchState;
+
+typedef struct PrefetchEntry PrefetchEntry;
+struct PrefetchEntry {
+    PrefetchEntry *next;  // Next entry in the work queue
+    char *path;
+    char *contents;
+    struct stat st;
+    PrefetchState state;
+    bool in_queue;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t file_ready = PTHREAD_COND_INITIALIZER;
+
+static HashMap files;     // Path -> PrefetchEntry
+static HashMap resolved;  // '"' or '<' followed by a filename -> path
+
+// The value in `resolved` for a filename that was not found
+#define NOT_FOUND ((void *)-1)
+
+static PrefetchEntry *queue;
+static PrefetchEntry *queue_tail;
+static bool started;
+
+PrefetchStats prefetch_stats;
+
+static char *format(char *fmt, char *s1, char *s2) {
+    char *buf = malloc(strlen(s1) + strlen(s2) + 2);
+    sprintf(buf, fmt, s1, s2);
+    return buf;
+}
+
+static bool is_file(char *path) {
+    struct stat st;
+    return !stat(path, &st);
+}
+
+// Resolves a filename the same way read_include_path does.
+static char *resolve(char *filename, bool quoted) {
+    if (quoted && is_file(filename))
+        return strdup(filename);
+
+    for (char **p = include_paths; *p; p++) {
+        char *path = format("%s/%s", *p, filename);
+        if (is_file(path))
+            return path;
+        free(path);
+    }
+    return NULL;
+}
+
+static void push_entry(PrefetchEntry *e) {
+    if (e->in_queue)
+        return;
+    e->in_queue = true;
+    e->next = NULL;
+    if (queue_tail)
+        queue_tail = queue_tail->next = e;
+    else
+        queue = queue_tail = e;
+    pthread_cond_signal(&work_ready);
+}
+
+// Queues a file found by a worker unless it is already known.
+// Called with the lock held.
+static void add_path(char *path) {
+    if (hashmap_get(&files, path)) {
+        free(path);
+        return;
+    }
+
+    PrefetchEntry *e = calloc(1, sizeof(PrefetchEntry));
+    e->path = path;
+    e->state = PF_QUEUED;
+    hashmap_put(&files, path, e);
+    push_entry(e);
+}
+
+// Finds #include directives in a file and queues the files they name.
+static void scan_includes(char *p) {
+    for (; *p; p++) {
+        while (*p == ' ' || *p == '\t')
+            p++;
+
+        if (*p == '#') {
+            p++;
+            while (*p == ' ' || *p == '\t')
+                p++;
+
+            if (!strncmp(p, "include", 7)) {
+                p += 7;
+                while (*p == ' ' || *p == '\t')
+                    p++;
+
+                char close = (*p == '"') ? '"' : (*p == '<') ? '>' : 0;
+                char *end = close ? strchr(p + 1, close) : NULL;
+                char *nl = strchr(p, '\n');
+
+                if (end && (!nl || end < nl)) {
+                    // The key is the opening quote followed by the name.
+                    char *key = strndup(p, end - p);
+                    pthread_mutex_lock(&lock);
+                    bool seen = hashmap_get(&resolved, key);
+                    pthread_mutex_unlock(&lock);
+
+                    char *path = NULL;
+                    if (!seen)
+                        path = resolve(key + 1, close == '"');
+
+                    pthread_mutex_lock(&lock);
+                    if (hashmap_get(&resolved, key)) {
+                        free(key);
+                        free(path);
+                    } else if (path) {
+                        hashmap_put(&resolved, key, path);
+                        add_path(strdup(path));
+                    } else {
+                        hashmap_put(&resolved, key, NOT_FOUND);
+                    }
+                    pthread_mutex_unlock(&lock);
+                }
+            }
+        }
+
+        p = strchr(p, '\n');
+        if (!p)
+            return;
+    }
+}
+
+static void *worker(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (!queue)
+            pthread_cond_wait(&work_ready, &lock);
+
+        PrefetchEntry *e = queue;
+        queue = e->next;
+        if (!queue)
+            queue_tail = NULL;
+        e->in_queue = false;
+
+        // The main thread may have claimed the file in the meantime.
+        if (e->state != PF_QUEUED) {
+            pthread_mutex_unlock(&lock);
+            continue;
+        }
+        e->state = PF_RUNNING;
+        char *contents = e->contents;
+        pthread_mutex_unlock(&lock);
+
+        struct stat st;
+        if (!contents)
+            contents = read_file(e->path, &st);
+
+        pthread_mutex_lock(&lock);
+        if (contents && !e->contents) {
+            e->contents = contents;
+            e->st = st;
+        }
+        pthread_cond_broadcast(&file_ready);
+        pthread_mutex_unlock(&lock);
+
+        // Scanning the file also faults its pages in.
+        if (contents)
+            scan_includes(contents);
+
+        pthread_mutex_lock(&lock);
+        e->state = contents ? PF_DONE : PF_FAILED;
+        pthread_cond_broadcast(&file_ready);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+static void start_workers(void) {
+    started = true;
+    for (int i = 0; i < opt_prefetch_threads; i++) {
+        pthread_t thr;
+        if (pthread_create(&thr, NULL, worker, NULL) == 0)
+            pthread_detach(thr);
+    }
+}
+
+// Returns the path of an included file if a worker has already
+// resolved it, or NULL otherwise.
+char *prefetched_include_path(char *filename, bool quoted) {
+    char *key = format("%s%s", quoted ? "\"" : "<", filename);
+    pthread_mutex_lock(&lock);
+    char *path = hashmap_get(&resolved, key);
+    pthread_mutex_unlock(&lock);
+    free(key);
+    return (path == NOT_FOUND) ? NULL : path;
+}
+
+// Returns the contents of a file read by a worker, waiting for it if
+// a worker is reading it right now. Returns NULL if the caller should
+// read the file itself.
+char *take_prefetched_file(char *path, struct stat *st) {
+    pthread_mutex_lock(&lock);
+    PrefetchEntry *e = hashmap_get(&files, path);
+
+    if (e && !e->contents && e->state == PF_RUNNING) {
+        prefetch_stats.waits++;
+        while (!e->contents && e->state == PF_RUNNING)
+            pthread_cond_wait(&file_ready, &lock);
+    }
+
+    char *contents = NULL;
+    if (e && e->contents) {
+        contents = e->contents;
+        *st = e->st;
+        prefetch_stats.hits++;
+    } else {
+        // Read it on the main thread. A worker that has not picked up
+        // the file yet will skip it.
+        if (!e) {
+            e = calloc(1, sizeof(PrefetchEntry));
+            e->path = strdup(path);
+            hashmap_put(&files, e->path, e);
+        }
+        e->state = PF_MAIN;
+        prefetch_stats.misses++;
+    }
+    pthread_mutex_unlock(&lock);
+    return contents;
+}
+
+// Hands a file read by the main thread to the workers so that they
+// start prefetching the files it includes.
+void prefetch_includes(char *path, char *contents, struct stat *st) {
+    pthread_mutex_lock(&lock);
+    if (!started)
+        start_workers();
+
+    PrefetchEntry *e = hashmap_get(&files, path);
+    if (!e) {
+        e = calloc(1, sizeof(PrefetchEntry));
+        e->path = strdup(path);
+        e->state = PF_MAIN;
+        hashmap_put(&files, e->path, e);
+    }
+
+    if (e->state == PF_MAIN) {
+        e->contents = contents;
+        e->st = *st;
+        e->state = PF_QUEUED;
+        push_entry(e);
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -1,29 +1,59 @@
 #include "nsc.h"
+#include <dirent.h>
 
 typedef struct MacroParam MacroParam;
 struct MacroParam {
     MacroParam *next;
-    char *name;
+    Atom *name;
 };
 
 typedef struct MacroArg MacroArg;
 struct MacroArg {
     MacroArg *next;
-    char *name;
-    Token *tok;
+    Atom *name;
+    Token **toks;  // Tokens of the argument
+    int len;
+    Token *tok;    // The same tokens as a list, built for `subst` only
 };
 
 typedef struct Macro Macro;
 struct Macro {
-    Macro *next;
-    char *name;
+    Atom *name;
     bool is_objlike;  // Object-like or function-like
     MacroParam *params;
     bool is_variadic;
+    bool has_paste;   // The body contains # or ##
     Token *body;
-    bool deleted;
+
+    // For -fpp-stats
+    long expansions;
+    long tokens;      // Tokens read from expansions of the macro
+    Macro *next_expanded;
+
+    // Memoized expansion of an object-like macro. See memoize_macro.
+    long memo_gen;     // `macro_gen` when last computed or checked
+    Token *expansion;  // NULL if the macro is not pure
+    Macro **deps;      // Macros the expansion goes through
+    int ndeps;
+    bool memoizing;    // The expansion is being computed
 };
 
+// The preprocessor reads tokens from a stack of frames. The bottom
+// frame reads a token list given to preprocess2, each #include pushes
+// a frame that reads the included file, and each macro expansion
+// pushes a frame that reads the macro body. A parameter in the body
+// pushes a frame that reads the argument.
+//
+// Token lists in frames are never modified, so expanding a macro
+// does not copy its body. Body and argument tokens are copied only
+// when they are read, which is when their hidesets are assigned.
+// Tokens read from files are passed through as they are.
+typedef enum {
+    FR_FILE,   // Tokens of a file or of a list passed to preprocess2
+    FR_MACRO,  // Tokens of a macro body
+    FR_ARG,    // Tokens of a macro argument
+} FrameKind;
+
 // `#if` can be nested, so we use a stack to manage nested `#if`s.
 typedef struct CondIncl CondIncl;
 struct CondIncl {
@@ -35,16 +65,132 @@ struct CondIncl {
     bool included;
 };
 
+// Files are identified by their device and inode numbers, so a file
+// reached by different paths (for example "a/../b.h" and "b.h", or
+// through a symlink) has a single entry in `files`.
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+} FileId;
+
+typedef struct {
+    FileId id;
+    bool pragma_once;    // The file contains #pragma once
+    Atom *guard;         // The include guard macro of the file
+    bool is_dependency;  // The file is in `dependencies`
+    bool is_system;      // See Dependency
+
+    // For -fpp-stats
+    char *path;          // The path the file was first found at
+    long size;
+    long included;       // Times the file was read
+    long skipped;        // Times it was skipped by its guard or #pragma once
+    long tokens;         // Tokens lexed from the file
+    long nsec;           // Time spent in the file and the files it includes
+} FileInfo;
+
+// A resolved #include filename
+typedef struct {
+    char *path;  // NULL if the file was not found
+    int nstats;  // Number of stat() calls the search took
+} IncludePath;
+
+// The names in an include directory. Directories are listed when
+// they are first searched, so that a file that is not in a directory
+// is rejected without calling stat().
+typedef struct {
+    HashMap names;
+    bool loaded;
+    bool listed;  // False if the directory could not be read
+} DirListing;
+
+typedef struct Frame Frame;
+struct Frame {
+    Frame *next;      // The frame below
+    FrameKind kind;
+    Token *tok;       // Next token if FR_FILE or FR_MACRO
+    Token **toks;     // Tokens if FR_ARG
+    int pos;
+    int len;
+    Hideset *hs;      // Added to the hidesets of tokens read
+    MacroArg *args;   // Arguments substituted for parameters
+    bool owned;       // Tokens are private copies and can be modified
+    FileInfo *file;   // The included file if FR_FILE
+    Macro *macro;     // The expanded macro if counted by -fpp-stats
+    long start_nsec;  // When the file was entered if -fpp-stats
+    bool line;        // FR_FILE ends at the end of the line
+
+    // Include guard detection for FR_FILE. See directive().
+    Token *first;           // First token of the file
+    Atom *guard;            // Macro tested by #ifndef on the first line
+    CondIncl *guard_cond;   // The #ifndef on the first line
+    Token *guard_define;    // First token after the #ifndef line
+    bool guard_defined;     // The guard is defined on the next line
+};
+
+// Macro dictionary. It is an open-addressing hash table with linear
+// probing keyed by atoms, so a lookup compares pointers only. The
+// capacity is a power of two and the table is kept at most half full.
+typedef struct {
+    Macro **slots;
+    int capacity;
+    int used;
+} MacroTable;
+
+
+// A hideset is an immutable set of macro names. Hidesets are
+// hash-consed, so two hidesets are equal if and only if they are the
+// same object, and the empty set is NULL. Names are sorted by address.
 typedef struct Hideset Hideset;
 struct Hideset {
-    Hideset *next;
-    char *name;
+    unsigned int hash;
+    int len;
+    Atom **names;  // Allocated right after the hideset
 };
 
-static Macro *macros;
+// The table of all hidesets, an open-addressing hash table. Its slots
+// are allocated with malloc and hold hidesets from pp_arena, so it
+// must not be used after pp_arena is released.
+typedef struct {
+    Hideset **slots;
+    int capacity;
+    int used;
+} HidesetTable;
+
+// A cached result of hideset_union or hideset_intersection. Macro
+// bodies are expanded with the same pair of hidesets over and over,
+// so a small direct-mapped cache catches most operations.
+typedef struct {
+    Hideset *hs1;
+    Hideset *hs2;
+    Hideset *result;
+} HidesetMemo;
+
+#define HIDESET_MEMO_SIZE 1024
+
+static MacroTable macros;
+static HashMap files;          // FileId -> FileInfo
+static HashMap files_by_path;  // Path of an included file -> FileInfo
+static HashMap include_cache;  // '"' or '<' followed by a filename -> IncludePath
+static DirListing *dir_listings;
+
+Dependency *dependencies;
+IncludeStats include_stats;
+static Frame *frames;
+static Frame *free_frames;
+static bool token_from_file;
+static HidesetTable hidesets;
+static HidesetMemo union_memo[HIDESET_MEMO_SIZE];
+static HidesetMemo intersection_memo[HIDESET_MEMO_SIZE];
 static Macro *file_macro;
 static Macro *line_macro;
+static long macro_gen = 1;  // Incremented when a macro is defined or undefined
+static Macro *expanded_macros;  // For -fpp-stats, including undefined ones
+static int nexpanded;
 static CondIncl *cond_incl;
+static Dependency **last_dependency = &dependencies;
+static Token *last_origin;                      // See read_token
+static void (*file_hook)(Token *tok, int flag);  // See preprocess_stream
 
 static Token *preprocess2(Token *tok);
 static Macro *find_macro(Token *tok);
@@ -65,7 +211,7 @@ static Token *skip_line(Token *tok) {
 }
 
 static Token *copy_token(Token *tok) {
-    Token *t = malloc(sizeof(Token));
+    Token *t = arena_alloc(&token_arena, sizeof(Token));
     *t = *tok;
     t->next = NULL;
     return t;
@@ -78,63 +224,159 @@ static Token *new_eof(Token *tok) {
     return t;
 }
 
-static Hideset *new_hideset(char *name) {
-    Hideset *hs = calloc(1, sizeof(Hideset));
-    hs->name = name;
-    return hs;
+static unsigned int hash_names(Atom **names, int len) {
+    unsigned int hash = 0;
+    for (int i = 0; i < len; i++)
+        hash = hash * 31 + names[i]->hash;
+    return hash;
 }
 
-static Hideset *hideset_union(Hideset *hs1, Hideset *hs2) {
-    Hideset head = {};
-    Hideset *cur = &head;
+static Hideset **hideset_slot(Atom **names, int len, unsigned int hash) {
+    int mask = hidesets.capacity - 1;
+    int i = hash & mask;
+    for (; hidesets.slots[i]; i = (i + 1) & mask) {
+        Hideset *hs = hidesets.slots[i];
+        if (hs->hash == hash && hs->len == len &&
+            !memcmp(hs->names, names, sizeof(Atom *) * len))
+            break;
+    }
+    return &hidesets.slots[i];
+}
 
-    for (; hs1; hs1 = hs1->next)
-        cur = cur->next = new_hideset(hs1->name);
-    cur->next = hs2;
-    return head.next;
+static void grow_hideset_table(void) {
+    HidesetTable old = hidesets;
+    hidesets.capacity = old.capacity ? old.capacity * 2 : 1024;
+    hidesets.slots = calloc(hidesets.capacity, sizeof(Hideset *));
+    for (int i = 0; i < old.capacity; i++) {
+        Hideset *hs = old.slots[i];
+        if (hs)
+            *hideset_slot(hs->names, hs->len, hs->hash) = hs;
+    }
+    free(old.slots);
 }
 
-static bool hideset_contains(Hideset *hs, char *s, int len) {
-    for (; hs; hs = hs->next)
-        if (strlen(hs->name) == len && !strncmp(hs->name, s, len))
-            return true;
-    return false;
+// Returns the hideset consisting of given names, which must be sorted.
+static Hideset *intern_hideset(Atom **names, int len) {
+    if (len == 0)
+        return NULL;
+
+    if ((hidesets.used + 1) * 2 > hidesets.capacity)
+        grow_hideset_table();
+
+    unsigned int hash = hash_names(names, len);
+    Hideset **slot = hideset_slot(names, len, hash);
+    if (*slot)
+        return *slot;
+
+    Hideset *hs = arena_alloc(&pp_arena, sizeof(Hideset) + sizeof(Atom *) * len);
+    hs->hash = hash;
+    hs->len = len;
+    hs->names = (Atom **)(hs + 1);
+    memcpy(hs->names, names, sizeof(Atom *) * len);
+    hidesets.used++;
+    *slot = hs;
+    return hs;
 }
 
-static Hideset *hideset_intersection(Hideset *hs1, Hideset *hs2) {
-    Hideset head = {};
-    Hideset *cur = &head;
+static Hideset *new_hideset(Atom *name) {
+    return intern_hideset(&name, 1);
+}
 
-    for (; hs1; hs1 = hs1->next)
-        if (hideset_contains(hs2, hs1->name, strlen(hs1->name)))
-            cur = cur->next = new_hideset(hs1->name);
-    return head.next;
+static bool name_less(Atom *a, Atom *b) {
+    return (unsigned long)a < (unsigned long)b;
 }
 
-static Token *add_hideset(Token *tok, Hideset *hs) {
-    Token head = {};
-    Token *cur = &head;
+// Returns a buffer that can hold `len` names while a new hideset is
+// being built.
+static Atom **hideset_buf(int len) {
+    static Atom **buf;
+    static int cap;
+    if (cap < len) {
+        cap = len * 2;
+        buf = realloc(buf, sizeof(Atom *) * cap);
+    }
+    return buf;
+}
 
-    for (; tok; tok = tok->next) {
-        Token *t = copy_token(tok);
-        t->hideset = hideset_union(t->hideset, hs);
-        cur = cur->next = t;
+static HidesetMemo *find_memo(HidesetMemo *memo, Hideset *hs1, Hideset *hs2) {
+    unsigned long key = (unsigned long)hs1 * 31 + (unsigned long)hs2;
+    return &memo[(key >> 4) & (HIDESET_MEMO_SIZE - 1)];
+}
+
+static Hideset *hideset_union(Hideset *hs1, Hideset *hs2) {
+    if (!hs1 || hs1 == hs2)
+        return hs2;
+    if (!hs2)
+        return hs1;
+
+    HidesetMemo *memo = find_memo(union_memo, hs1, hs2);
+    if (memo->hs1 == hs1 && memo->hs2 == hs2)
+        return memo->result;
+
+    Atom **buf = hideset_buf(hs1->len + hs2->len);
+    int i = 0, j = 0, n = 0;
+    while (i < hs1->len && j < hs2->len) {
+        if (hs1->names[i] == hs2->names[j]) {
+            buf[n++] = hs1->names[i++];
+            j++;
+        } else if (name_less(hs1->names[i], hs2->names[j])) {
+            buf[n++] = hs1->names[i++];
+        } else {
+            buf[n++] = hs2->names[j++];
+        }
     }
-    return head.next;
+    while (i < hs1->len)
+        buf[n++] = hs1->names[i++];
+    while (j < hs2->len)
+        buf[n++] = hs2->names[j++];
+
+    *memo = (HidesetMemo){hs1, hs2, intern_hideset(buf, n)};
+    return memo->result;
 }
 
-// Append tok2 to the end of tok1.
-static Token *append(Token *tok1, Token *tok2) {
-    if (!tok1 || tok1->kind == TK_EOF)
-        return tok2;
+static bool hideset_contains(Hideset *hs, Atom *name) {
+    if (!hs)
+        return false;
 
-    Token head = {};
-    Token *cur = &head;
+    // Binary search
+    int lo = 0, hi = hs->len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (hs->names[mid] == name)
+            return true;
+        if (name_less(hs->names[mid], name))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return false;
+}
 
-    for (; tok1 && tok1->kind != TK_EOF; tok1 = tok1->next)
-        cur = cur->next = copy_token(tok1);
-    cur->next = tok2;
-    return head.next;
+static Hideset *hideset_intersection(Hideset *hs1, Hideset *hs2) {
+    if (!hs1 || !hs2)
+        return NULL;
+    if (hs1 == hs2)
+        return hs1;
+
+    HidesetMemo *memo = find_memo(intersection_memo, hs1, hs2);
+    if (memo->hs1 == hs1 && memo->hs2 == hs2)
+        return memo->result;
+
+    Atom **buf = hideset_buf(hs1->len < hs2->len ? hs1->len : hs2->len);
+    int i = 0, j = 0, n = 0;
+    while (i < hs1->len && j < hs2->len) {
+        if (hs1->names[i] == hs2->names[j]) {
+            buf[n++] = hs1->names[i++];
+            j++;
+        } else if (name_less(hs1->names[i], hs2->names[j])) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+
+    *memo = (HidesetMemo){hs1, hs2, intern_hideset(buf, n)};
+    return memo->result;
 }
 
 static Token *skip_cond_incl2(Token *tok) {
@@ -155,6 +397,20 @@ static Token *skip_cond_incl2(Token *tok) {
 // Skip until next `#else`, `#elif` or `#endif`.
 // Nested `#if` and `#endif` are skipped.
 static Token *skip_cond_incl(Token *tok) {
+    while (!tok->at_bol)
+        tok = tok->next;
+
+    // If the rest of the file has not been tokenized yet, skip the
+    // group in the source text instead.
+    if (tok->next && tok->next->kind == TK_MORE) {
+        long ntokens = tokenize_stats.tokens;
+        Token *rest = skip_excluded_group(tok);
+        if (frames->file)
+            frames->file->tokens = frames->file->tokens + tokenize_stats.tokens - ntokens;
+        if (rest)
+            return rest;
+    }
+
     while (tok->kind != TK_EOF) {
         if (is_hash(tok) &&
             (equal(tok->next, "if") || equal(tok->next, "ifdef") ||
@@ -181,7 +437,7 @@ static char *quote_string(char *str) {
         bufsize++;
     }
 
-    char *buf = malloc(bufsize);
+    char *buf = arena_alloc(&token_arena, bufsize);
     char *p = buf;
     *p++ = '"';
     for (int i = 0; str[i]; i++) {
@@ -194,9 +450,19 @@ static char *quote_string(char *str) {
     return buf;
 }
 
+// Tokenizes a string that the preprocessor has created on behalf of
+// `tmpl`. The new tokens are reported at the same file and line as
+// `tmpl`.
+static Token *tokenize_tmpl(char *buf, Token *tmpl) {
+    File *orig = get_file(tmpl);
+    File *file = new_file(orig->name, orig->file_no, buf);
+    file->line_delta = get_line_no(tmpl) - 1;
+    return tokenize(file);
+}
+
 static Token *new_str_token(char *str, Token *tmpl) {
     char *buf = quote_string(str);
-    return tokenize(tmpl->filename, tmpl->file_no, buf);
+    return tokenize_tmpl(buf, tmpl);
 }
 
 // Copy all tokens until the next newline, terminate them with
@@ -215,73 +481,13 @@ static Token *copy_line(Token **rest, Token *tok) {
 }
 
 static Token *new_num_token(int val, Token *tmpl) {
-    char *buf = malloc(20);
+    char *buf = arena_alloc(&token_arena, 20);
     sprintf(buf, "%d\n", val);
-    return tokenize(tmpl->filename, tmpl->file_no, buf);
-}
-
-static Token *read_const_expr(Token **rest, Token *tok) {
-    tok = copy_line(rest, tok);
-
-    Token head = {};
-    Token *cur = &head;
-
-    while (tok->kind != TK_EOF) {
-        // "defined(foo)" or "defined foo" becomes "1" if macro "foo"
-        // is defined. Otherwise "0".
-        if (equal(tok, "defined")) {
-            Token *start = tok;
-            bool has_paren = consume(&tok, tok->next, "(");
-
-            if (tok->kind != TK_IDENT)
-                error_tok(start, "macro name must be an identifier");
-            Macro *m = find_macro(tok);
-            tok = tok->next;
-
-            if (has_paren)
-                tok = skip(tok, ")");
-
-            cur = cur->next = new_num_token(m ? 1 : 0, start);
-            continue;
-        }
-
-        cur = cur->next = tok;
-        tok = tok->next;
-    }
-
-    cur->next = tok;
-    return head.next;
-}
-
-// Read and evaluate a constant expression.
-static long eval_const_expr(Token **rest, Token *tok) {
-    Token *expr = read_const_expr(rest, tok);
-    expr = preprocess2(expr);
-
-    // The standard requires we replace remaining non-macro
-    // identifiers with "0" before evaluating a constant expression.
-    // I don't know the rationale behind it, but I guess there's a
-    // historical reason.
-    for (Token *t = expr; t->kind != TK_EOF; t = t->next) {
-        if (t->kind == TK_IDENT) {
-            Token *next = t->next;
-            *t = *new_num_token(0, t);
-            t->next = next;
-        }
-    }
-
-    // Convert pp-numbers to regular numbers
-    convert_pp_tokens(expr);
-
-    Token *rest2;
-    long val = const_expr(&rest2, expr);
-    if (rest2->kind != TK_EOF)
-        error_tok(rest2, "extra token");
-    return val;
+    return tokenize_tmpl(buf, tmpl);
 }
 
 static CondIncl *push_cond_incl(Token *tok, bool included) {
-    CondIncl *ci = calloc(1, sizeof(CondIncl));
+    CondIncl *ci = arena_alloc(&pp_arena, sizeof(CondIncl));
     ci->next = cond_incl;
     ci->ctx = IN_THEN;
     ci->tok = tok;
@@ -290,26 +496,88 @@ static CondIncl *push_cond_incl(Token *tok, bool included) {
     return ci;
 }
 
+// Returns the slot for a given name, which is either the slot holding
+// its macro or the empty slot where it would be inserted.
+static Macro **macro_slot(Atom *name) {
+    int mask = macros.capacity - 1;
+    int i = name->hash & mask;
+    while (macros.slots[i] && macros.slots[i]->name != name)
+        i = (i + 1) & mask;
+    return &macros.slots[i];
+}
+
+static void grow_macro_table(void) {
+    MacroTable old = macros;
+    macros.capacity = old.capacity ? old.capacity * 2 : 1024;
+    macros.slots = calloc(macros.capacity, sizeof(Macro *));
+    for (int i = 0; i < old.capacity; i++)
+        if (old.slots[i])
+            *macro_slot(old.slots[i]->name) = old.slots[i];
+    free(old.slots);
+}
+
+static Macro *lookup_macro(Atom *name) {
+    if (!macros.used)
+        return NULL;
+    return *macro_slot(name);
+}
+
 static Macro *find_macro(Token *tok) {
     if (tok->kind != TK_IDENT)
         return NULL;
+    return lookup_macro(tok->u.atom);
+}
 
-    for (Macro *m = macros; m; m = m->next)
-        if (strlen(m->name) == tok->len && !strncmp(m->name, tok->loc, tok->len))
-            return m->deleted ? NULL : m;
-    return NULL;
+// Inserts a macro into the table, replacing any macro of the same name.
+static void insert_macro(Macro *m) {
+    if ((macros.used + 1) * 2 > macros.capacity)
+        grow_macro_table();
+
+    Macro **slot = macro_slot(m->name);
+    if (!*slot)
+        macros.used++;
+    *slot = m;
+    macro_gen++;
 }
 
-static Macro *add_macro(char *name, bool is_objlike, Token *body) {
-    Macro *m = calloc(1, sizeof(Macro));
-    m->next = macros;
+// Defines a macro, replacing an existing macro of the same name.
+static Macro *add_macro(Atom *name, bool is_objlike, Token *body) {
+    Macro *m = arena_alloc(&pp_arena, sizeof(Macro));
     m->name = name;
     m->is_objlike = is_objlike;
     m->body = body;
-    macros = m;
+    insert_macro(m);
     return m;
 }
 
+// Removes a macro. The entries that follow it in the same probe
+// sequence are moved back so that no tombstone is left behind.
+static void undef_macro(Atom *name) {
+    if (!macros.used)
+        return;
+
+    Macro **slot = macro_slot(name);
+    if (!*slot)
+        return;
+
+    int mask = macros.capacity - 1;
+    int i = slot - macros.slots;
+    macros.slots[i] = NULL;
+    macros.used--;
+    macro_gen++;
+
+    for (int j = (i + 1) & mask; macros.slots[j]; j = (j + 1) & mask) {
+        // An entry can fill the hole at `i` if its home slot is not
+        // cyclically in (i, j].
+        int home = macros.slots[j]->name->hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            macros.slots[i] = macros.slots[j];
+            macros.slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
 static MacroParam *read_macro_params(Token **rest, Token *tok, bool *is_variadic) {
     MacroParam head = {};
     MacroParam *cur = &head;
@@ -327,8 +595,8 @@ static MacroParam *read_macro_params(Token **rest, Token *tok, bool *is_variadic
 
         if (tok->kind != TK_IDENT)
             error_tok(tok, "expected an identifier");
-        MacroParam *m = calloc(1, sizeof(MacroParam));
-        m->name = strndup(tok->loc, tok->len);
+        MacroParam *m = arena_alloc(&pp_arena, sizeof(MacroParam));
+        m->name = tok->u.atom;
         cur = cur->next = m;
         tok = tok->next;
     }
@@ -340,7 +608,7 @@ static MacroParam *read_macro_params(Token **rest, Token *tok, bool *is_variadic
 static void read_macro_definition(Token **rest, Token *tok) {
     if (tok->kind != TK_IDENT)
         error_tok(tok, "macro name must be an identifier");
-    char *name = strndup(tok->loc, tok->len);
+    Atom *name = tok->u.atom;
     tok = tok->next;
 
     if (!tok->has_space && equal(tok, "(")) {
@@ -351,18 +619,172 @@ static void read_macro_definition(Token **rest, Token *tok) {
         Macro *m = add_macro(name, false, copy_line(rest, tok));
         m->params = params;
         m->is_variadic = is_variadic;
+
+        for (Token *t = m->body; t->kind != TK_EOF; t = t->next)
+            if (equal(t, "#") || equal(t, "##"))
+                m->has_paste = true;
     } else {
         // Object-like macro
         add_macro(name, true, copy_line(rest, tok));
     }
 }
 
-static MacroArg *read_macro_arg_one(Token **rest, Token *tok, bool read_rest) {
-    Token head = {};
-    Token *cur = &head;
+static Frame *push_frame(FrameKind kind, Hideset *hs) {
+    Frame *f = free_frames;
+    if (f)
+        free_frames = f->next;
+    else
+        f = arena_alloc(&pp_arena, sizeof(Frame));
+
+    *f = (Frame){frames, kind};
+    f->hs = hs;
+    frames = f;
+    return f;
+}
+
+static void pop_frame(void) {
+    Frame *f = frames;
+    frames = f->next;
+    f->next = free_frames;
+    free_frames = f;
+}
+
+static void push_file_frame(Token *tok, FileInfo *file) {
+    Frame *f = push_frame(FR_FILE, NULL);
+    f->tok = tok;
+    f->file = file;
+    f->first = tok;
+}
+
+static MacroArg *find_macro_arg(MacroArg *args, Token *tok) {
+    if (tok->kind != TK_IDENT)
+        return NULL;
+
+    for (MacroArg *ap = args; ap; ap = ap->next)
+        if (ap->name == tok->u.atom)
+            return ap;
+    return NULL;
+}
+
+// Returns a copy of a given token with `hs` added to its hideset.
+static Token *materialize(Token *tok, Hideset *hs) {
+    Token *t = copy_token(tok);
+    t->hideset = hideset_union(t->hideset, hs);
+    return t;
+}
+
+// Returns the next token from the frame stack. If `consume` is false,
+// the token is left in place, but exhausted frames are still popped
+// and arguments are still pushed. The end of the bottom frame is
+// never consumed.
+static Token *read_frames(bool consume) {
+    for (;;) {
+        Frame *f = frames;
+
+        switch (f->kind) {
+        case FR_FILE: {
+            Token *tok = f->tok;
+            if (tok->kind == TK_EOF && f->next) {
+                pop_frame();
+                if (f->file && opt_pp_stats)
+                    f->file->nsec = f->file->nsec + now_nsec() - f->start_nsec;
+                if (f->file && file_hook)
+                    file_hook(frames->tok, 2);
+                continue;
+            }
+
+            // A line read by eval_const_expr ends with a stand-in EOF.
+            if (f->line && tok->at_bol) {
+                static Token eol;
+                eol = *tok;
+                eol.kind = TK_EOF;
+                eol.len = 0;
+                return &eol;
+            }
+
+            // A file is tokenized further as it is read. The rest is
+            // linked when the token before it is consumed, so that
+            // the line of a directive is complete when it is read.
+            if (consume && tok->kind != TK_EOF) {
+                if (tok->next->kind == TK_MORE) {
+                    long ntokens = tokenize_stats.tokens;
+                    tok->next = lex_more(tok->next->u.lexer);
+                    if (f->file)
+                        f->file->tokens = f->file->tokens + tokenize_stats.tokens - ntokens;
+                }
+                f->tok = tok->next;
+            }
+            token_from_file = true;
+            return tok;
+        }
+        case FR_MACRO: {
+            Token *tok = f->tok;
+            if (!tok || tok->kind == TK_EOF) {
+                pop_frame();
+                continue;
+            }
+
+            MacroArg *arg = f->args ? find_macro_arg(f->args, tok) : NULL;
+            if (arg) {
+                f->tok = tok->next;
+                Frame *f2 = push_frame(FR_ARG, f->hs);
+                f2->toks = arg->toks;
+                f2->len = arg->len;
+                f2->macro = f->macro;
+                continue;
+            }
+
+            if (!consume)
+                return tok;
+            if (f->macro)
+                f->macro->tokens++;
+            f->tok = tok->next;
+            token_from_file = false;
+            if (!f->owned)
+                return materialize(tok, f->hs);
+            tok->hideset = hideset_union(tok->hideset, f->hs);
+            return tok;
+        }
+        case FR_ARG:
+            if (f->pos == f->len) {
+                pop_frame();
+                continue;
+            }
+            if (!consume)
+                return f->toks[f->pos];
+            if (f->macro)
+                f->macro->tokens++;
+            token_from_file = false;
+            return materialize(f->toks[f->pos++], f->hs);
+        }
+    }
+}
+
+static Token *next_token(void) {
+    return read_frames(true);
+}
+
+static Token *peek_token(void) {
+    return read_frames(false);
+}
+
+static Token *expect_token(char *op) {
+    Token *tok = next_token();
+    if (!equal(tok, op))
+        error_tok(tok, "expected '%s'", op);
+    return tok;
+}
+
+static MacroArg *read_macro_arg_one(bool read_rest) {
+    // Tokens are collected in a scratch buffer first. Reading an
+    // argument never expands macros, so this is not reentered.
+    static Token **buf;
+    static int cap;
+    int len = 0;
     int level = 0;
 
     for (;;) {
+        Token *tok = peek_token();
         if (level == 0 && equal(tok, ")"))
             break;
         if (level == 0 && !read_rest && equal(tok, ","))
@@ -376,20 +798,24 @@ static MacroArg *read_macro_arg_one(Token **rest, Token *tok, bool read_rest) {
         else if (equal(tok, ")"))
             level--;
 
-        cur = cur->next = copy_token(tok);
-        tok = tok->next;
+        if (len == cap) {
+            cap = cap ? cap * 2 : 64;
+            buf = realloc(buf, sizeof(Token *) * cap);
+        }
+        buf[len++] = next_token();
     }
 
-    MacroArg *arg = calloc(1, sizeof(MacroArg));
-    arg->tok = head.next;
-    *rest = tok;
+    MacroArg *arg = arena_alloc(&pp_arena, sizeof(MacroArg));
+    arg->toks = arena_alloc(&pp_arena, sizeof(Token *) * len);
+    memcpy(arg->toks, buf, sizeof(Token *) * len);
+    arg->len = len;
     return arg;
 }
 
-static MacroArg *
-read_macro_args(Token **rest, Token *tok, MacroParam *params, bool is_variadic) {
-    Token *start = tok;
-    tok = tok->next->next;
+// Reads the arguments of a function-like macro call. The next token
+// must be "(". The closing parenthesis is stored to `rparen`.
+static MacroArg *read_macro_args(MacroParam *params, bool is_variadic, Token **rparen) {
+    next_token();
 
     MacroArg head = {};
     MacroArg *cur = &head;
@@ -397,22 +823,19 @@ read_macro_args(Token **rest, Token *tok, MacroParam *params, bool is_variadic)
     MacroParam *pp = params;
     for (; pp; pp = pp->next) {
         if (cur != &head)
-            tok = skip(tok, ",");
-        cur = cur->next = read_macro_arg_one(&tok, tok, false);
+            expect_token(",");
+        cur = cur->next = read_macro_arg_one(false);
         cur->name = pp->name;
     }
 
     if (is_variadic) {
         if (pp != params)
-            tok = skip(tok, ",");
-        cur = cur->next = read_macro_arg_one(&tok, tok, true);
-        cur->name = "__VA_ARGS__";
-    } else if (pp) {
-        error_tok(start, "too many arguments");
+            expect_token(",");
+        cur = cur->next = read_macro_arg_one(true);
+        cur->name = intern("__VA_ARGS__", 11);
     }
 
-    skip(tok, ")");
-    *rest = tok;
+    *rparen = expect_token(")");
     return head.next;
 }
 
@@ -422,10 +845,13 @@ read_macro_args(Token **rest, Token *tok, MacroParam *params, bool is_variadic)
 static Token *EMPTY = (Token *)-1;
 
 static Token *find_arg(MacroArg *args, Token *tok) {
-    for (MacroArg *ap = args; ap; ap = ap->next)
-        if (tok->len == strlen(ap->name) && !strncmp(tok->loc, ap->name, tok->len))
-            return ap->tok ? ap->tok : EMPTY;
-    return NULL;
+    if (tok->kind != TK_IDENT)
+        return NULL;
+
+    MacroArg *ap = find_macro_arg(args, tok);
+    if (!ap)
+        return NULL;
+    return ap->tok ? ap->tok : EMPTY;
 }
 
 // Concatenates all tokens in `tok` and returns a new string.
@@ -438,7 +864,7 @@ static char *join_tokens(Token *tok, Token *end) {
         len += t->len;
     }
 
-    char *buf = malloc(len);
+    char *buf = arena_alloc(&pp_arena, len);
 
     // Copy token texts.
     int pos = 0;
@@ -465,11 +891,11 @@ static Token *stringize(Token *hash, Token *arg) {
 // Concatenate two tokens to create a new token.
 static Token *paste(Token *lhs, Token *rhs) {
     // Paste the two tokens.
-    char *buf = malloc(lhs->len + rhs->len + 1);
+    char *buf = arena_alloc(&token_arena, lhs->len + rhs->len + 1);
     sprintf(buf, "%.*s%.*s", lhs->len, lhs->loc, rhs->len, rhs->loc);
 
     // Tokenize the resulting string.
-    Token *tok = tokenize(lhs->filename, lhs->file_no, buf);
+    Token *tok = tokenize_tmpl(buf, lhs);
     if (tok->next->kind != TK_EOF)
         error_tok(lhs, "pasting forms '%s', an invalid token", buf);
     return tok;
@@ -543,8 +969,134 @@ static Token *subst(Token *tok, MacroArg *args) {
     return head.next;
 }
 
-static bool expand_macro(Token **rest, Token *tok) {
-    if (hideset_contains(tok->hideset, tok->loc, tok->len))
+// Links the tokens of each argument into a list for `subst`.
+static void link_macro_args(MacroArg *args) {
+    for (MacroArg *ap = args; ap; ap = ap->next) {
+        Token head = {};
+        Token *cur = &head;
+        for (int i = 0; i < ap->len; i++)
+            cur = cur->next = copy_token(ap->toks[i]);
+        ap->tok = head.next;
+    }
+}
+
+// Pushes a frame for an expansion of `m`. With -fpp-stats, the frame
+// counts the tokens read from it.
+static Frame *push_macro_frame(Macro *m, Hideset *hs) {
+    Frame *f = push_frame(FR_MACRO, hs);
+    if (opt_pp_stats) {
+        if (!m->expansions++) {
+            m->next_expanded = expanded_macros;
+            expanded_macros = m;
+            nexpanded++;
+        }
+        f->macro = m;
+    }
+    return f;
+}
+
+// An object-like macro is pure if its expansion consists of literals
+// and punctuators only, such as `#define MAX_CONN (FOO_BASE + 64)`
+// where FOO_BASE is pure. The expansion of a pure macro does not
+// depend on where it is used, so it is computed once and read by every
+// later expansion instead of expanding the macros in it again.
+//
+// Each token of the memoized expansion has the hideset it would get
+// from an expansion of the macro by itself, without the macro's own
+// name. The invocation's hideset and the name are added as usual when
+// the tokens are read. An invocation's hideset never contains any of
+// the macros in the expansion, since that takes a cycle through the
+// macro, and a macro on a cycle is not pure.
+//
+// The expansion is valid as long as the macros it goes through are
+// defined as they were. That is checked only when a macro has been
+// defined or undefined since the last check.
+//
+// -fpp-stats counts the expansions of the macros nested in an
+// expansion, so nothing is memoized when it is given.
+static bool memoize_macro(Macro *m) {
+    if (opt_pp_stats)
+        return false;
+    if (m->memo_gen == macro_gen)
+        return m->expansion;
+
+    if (m->memo_gen) {
+        bool valid = true;
+        for (int i = 0; i < m->ndeps && valid; i++)
+            valid = (lookup_macro(m->deps[i]->name) == m->deps[i]);
+        if (valid) {
+            m->memo_gen = macro_gen;
+            return m->expansion;
+        }
+    }
+
+    if (m->memoizing)
+        return false;
+    m->memoizing = true;
+
+    // Dependencies are collected on a stack shared with the recursive
+    // calls for the macros in the body.
+    static Macro **deps;
+    static int deps_len;
+    static int deps_cap;
+    int base = deps_len;
+
+    Token head = {};
+    Token *cur = &head;
+    Token *tok = m->body;
+    bool pure = true;
+
+    for (; pure && tok->kind != TK_EOF; tok = tok->next) {
+        if (tok->kind != TK_IDENT) {
+            cur = cur->next = copy_token(tok);
+            continue;
+        }
+
+        Macro *m2 = lookup_macro(tok->u.atom);
+        if (!m2 || !m2->is_objlike || !m2->body || !memoize_macro(m2)) {
+            pure = false;
+            break;
+        }
+
+        Hideset *hs = new_hideset(m2->name);
+        for (Token *t = m2->expansion; t->kind != TK_EOF; t = t->next) {
+            cur = cur->next = copy_token(t);
+            cur->hideset = hideset_union(t->hideset, hs);
+        }
+
+        if (deps_len + m2->ndeps + 1 > deps_cap) {
+            deps_cap = (deps_len + m2->ndeps + 1) * 2;
+            deps = realloc(deps, sizeof(Macro *) * deps_cap);
+        }
+        deps[deps_len++] = m2;
+        memcpy(deps + deps_len, m2->deps, sizeof(Macro *) * m2->ndeps);
+        deps_len += m2->ndeps;
+    }
+
+    // A macro that is not pure has no dependencies, so it is not
+    // checked again even if the name that made it impure is defined
+    // later. That only costs the memoization.
+    int ndeps = deps_len - base;
+    deps_len = base;
+    m->memoizing = false;
+    m->memo_gen = macro_gen;
+    m->expansion = NULL;
+    m->ndeps = 0;
+    if (!pure)
+        return false;
+
+    cur->next = new_eof(tok);
+    m->expansion = head.next;
+    m->deps = arena_alloc(&pp_arena, sizeof(Macro *) * ndeps);
+    memcpy(m->deps, deps + base, sizeof(Macro *) * ndeps);
+    m->ndeps = ndeps;
+    return true;
+}
+
+// If `tok` is a macro, pushes a frame for its expansion and returns
+// true. Otherwise, returns false.
+static bool expand_macro(Token *tok) {
+    if (tok->kind != TK_IDENT || hideset_contains(tok->hideset, tok->u.atom))
         return false;
 
     Macro *m = find_macro(tok);
@@ -553,73 +1105,480 @@ static bool expand_macro(Token **rest, Token *tok) {
 
     // Object-like macro application
     if (m->is_objlike) {
-        if (m == file_macro) {
-            *rest = new_str_token(tok->filename, tok);
-            (*rest)->next = tok->next;
-            return true;
-        }
-
-        if (m == line_macro) {
-            *rest = new_num_token(tok->line_no, tok);
-            (*rest)->next = tok->next;
+        if (m == file_macro || m == line_macro) {
+            Frame *f = push_macro_frame(m, NULL);
+            f->owned = true;
+            if (m == file_macro)
+                f->tok = new_str_token(get_file(tok)->name, tok);
+            else
+                f->tok = new_num_token(get_line_no(tok), tok);
             return true;
         }
 
         Hideset *hs = hideset_union(tok->hideset, new_hideset(m->name));
-        Token *body = add_hideset(m->body, hs);
-        *rest = append(body, tok->next);
+        push_macro_frame(m, hs)->tok = memoize_macro(m) ? m->expansion : m->body;
         return true;
     }
 
     // If a funclike macro token is not followed by an argument list,
     // treat it as a normal identifier.
-    if (!equal(tok->next, "("))
+    if (!equal(peek_token(), "("))
         return false;
 
     // Function-like macro application
-    Token *macro_token = tok;
-    MacroArg *args = read_macro_args(&tok, tok, m->params, m->is_variadic);
-    Token *rparen = tok;
+    Token *rparen;
+    MacroArg *args = read_macro_args(m->params, m->is_variadic, &rparen);
 
     // Tokens that consist a func-like macro invocation may have different
     // hidesets, and if that's the case, it's not clear what the hideset
     // for the new tokens should be. We take the interesection of the
     // macro token and the closing parenthesis and use it as a new hideset
     // as explained in the Dave Prossor's algorithm.
-    Hideset *hs = hideset_intersection(macro_token->hideset, rparen->hideset);
+    Hideset *hs = hideset_intersection(tok->hideset, rparen->hideset);
     hs = hideset_union(hs, new_hideset(m->name));
 
-    Token *body = subst(m->body, args);
-    body = add_hideset(body, hs);
-    *rest = append(body, tok->next);
+    // A body with # or ## is substituted eagerly. Otherwise parameters
+    // are replaced as the body is read.
+    Frame *f = push_macro_frame(m, hs);
+    if (m->has_paste) {
+        link_macro_args(args);
+        f->tok = subst(m->body, args);
+        f->owned = true;
+    } else {
+        f->tok = m->body;
+        f->args = args;
+    }
     return true;
 }
 
+// #if and #elif expressions are evaluated directly on pp-tokens as
+// they come out of macro expansion, by precedence climbing. Every
+// integer has the widest integer type, long or unsigned long, as the
+// standard requires. Identifiers that remain after expansion are 0.
+//
+// `if_skip` is set in the operands of &&, || and ?: that are not
+// evaluated, so that 1 || 1 / 0 is not an error.
+typedef struct {
+    long val;
+    bool is_unsigned;
+} IfValue;
+
+static Token *if_tok;  // The next token of the expression
+static bool if_skip;
+
+static void if_cond(IfValue *v);
+
+// Reads the next token of the expression with macros expanded.
+static void if_next(void) {
+    do {
+        if_tok = next_token();
+    } while (expand_macro(if_tok));
+}
+
+// Returns the precedence of a binary operator, or 0 if `tok` is not
+// a binary operator.
+static int binary_prec(Token *tok) {
+    if (tok->kind != TK_RESERVED)
+        return 0;
+
+    char *p = tok->loc;
+    if (tok->len == 1) {
+        switch (*p) {
+            case '*': case '/': case '%': return 10;
+            case '+': case '-': return 9;
+            case '<': case '>': return 7;
+            case '&': return 5;
+            case '^': return 4;
+            case '|': return 3;
+        }
+        return 0;
+    }
+
+    if (tok->len == 2) {
+        if ((p[0] == '<' || p[0] == '>') && p[1] == p[0])
+            return 8;
+        if ((p[0] == '<' || p[0] == '>') && p[1] == '=')
+            return 7;
+        if ((p[0] == '=' || p[0] == '!') && p[1] == '=')
+            return 6;
+        if (p[0] == '&' && p[1] == '&')
+            return 2;
+        if (p[0] == '|' && p[1] == '|')
+            return 1;
+    }
+    return 0;
+}
+
+// "defined(foo)" or "defined foo" is 1 if macro "foo" is defined.
+// Otherwise 0. The name is not macro-expanded.
+static long if_defined(Token *start) {
+    Token *tok = next_token();
+    bool has_paren = equal(tok, "(");
+    if (has_paren)
+        tok = next_token();
+
+    if (tok->kind != TK_IDENT)
+        error_tok(start, "macro name must be an identifier");
+    bool defined = lookup_macro(tok->u.atom);
+
+    if (has_paren && !equal(next_token(), ")"))
+        error_tok(start, "expected ')'");
+    return defined;
+}
+
+static void if_primary(IfValue *v) {
+    Token *tok = if_tok;
+    *v = (IfValue){0, false};
+
+    if (equal(tok, "(")) {
+        if_next();
+        if_cond(v);
+        if (!equal(if_tok, ")"))
+            error_tok(if_tok, "expected ')'");
+        if_next();
+        return;
+    }
+
+    if (tok->kind == TK_IDENT) {
+        if (equal(tok, "defined"))
+            v->val = if_defined(tok);
+        if_next();
+        return;
+    }
+
+    if (tok->kind == TK_PP_NUM) {
+        unsigned long val;
+        if (!pp_int_value(tok, &val, &v->is_unsigned))
+            error_tok(tok, "invalid integer constant in preprocessor expression");
+        v->val = val;
+        if_next();
+        return;
+    }
+
+    // A character literal
+    if (tok->kind == TK_NUM) {
+        v->val = tok->u.lit->val;
+        if_next();
+        return;
+    }
+
+    if (tok->kind == TK_EOF)
+        error_tok(tok, "expected an expression");
+    error_tok(tok, "invalid token in preprocessor expression");
+}
+
+static void if_unary(IfValue *v) {
+    Token *tok = if_tok;
+    if (tok->kind != TK_RESERVED || tok->len != 1) {
+        if_primary(v);
+        return;
+    }
+
+    switch (*tok->loc) {
+        case '+':
+            if_next();
+            if_unary(v);
+            return;
+        case '-':
+            if_next();
+            if_unary(v);
+            v->val = -(unsigned long)v->val;
+            return;
+        case '~':
+            if_next();
+            if_unary(v);
+            v->val = ~v->val;
+            return;
+        case '!':
+            if_next();
+            if_unary(v);
+            *v = (IfValue){!v->val, false};
+            return;
+    }
+    if_primary(v);
+}
+
+// Applies `op` to `lhs` and `rhs` and stores the result in `lhs`.
+static void if_binary(IfValue *lhs, Token *op, IfValue *rhs) {
+    unsigned long l = lhs->val;
+    unsigned long r = rhs->val;
+    bool u = lhs->is_unsigned || rhs->is_unsigned;
+    char *p = op->loc;
+
+    // Comparisons yield a signed int, and shifts have the type of
+    // their left operand.
+    long val;
+    bool is_unsigned = u;
+
+    if (op->len == 2) {
+        is_unsigned = false;
+        switch (p[0]) {
+            case '<':
+                if (p[1] == '<') {
+                    val = l << (r & 63);
+                    is_unsigned = lhs->is_unsigned;
+                } else {
+                    val = u ? l <= r : lhs->val <= rhs->val;
+                }
+                break;
+            case '>':
+                if (p[1] == '>') {
+                    if (lhs->is_unsigned)
+                        val = l >> (r & 63);
+                    else
+                        val = lhs->val >> (r & 63);
+                    is_unsigned = lhs->is_unsigned;
+                } else {
+                    val = u ? l >= r : lhs->val >= rhs->val;
+                }
+                break;
+            case '=':
+                val = (l == r);
+                break;
+            default:
+                val = (l != r);
+                break;
+        }
+        *lhs = (IfValue){val, is_unsigned};
+        return;
+    }
+
+    switch (*p) {
+        case '*':
+            val = l * r;
+            break;
+        case '/':
+        case '%':
+            if (r == 0) {
+                if (!if_skip)
+                    error_tok(op, "division by zero in preprocessor expression");
+                val = 0;
+            } else if (u) {
+                val = (*p == '/') ? l / r : l % r;
+            } else if (lhs->val == LONG_MIN && rhs->val == -1) {
+                // LONG_MIN / -1 overflows.
+                val = (*p == '/') ? LONG_MIN : 0;
+            } else {
+                val = (*p == '/') ? lhs->val / rhs->val : lhs->val % rhs->val;
+            }
+            break;
+        case '+':
+            val = l + r;
+            break;
+        case '-':
+            val = l - r;
+            break;
+        case '<':
+            val = u ? l < r : lhs->val < rhs->val;
+            is_unsigned = false;
+            break;
+        case '>':
+            val = u ? l > r : lhs->val > rhs->val;
+            is_unsigned = false;
+            break;
+        case '&':
+            val = l & r;
+            break;
+        case '^':
+            val = l ^ r;
+            break;
+        default:
+            val = l | r;
+            break;
+    }
+    *lhs = (IfValue){val, is_unsigned};
+}
+
+// Parses binary operators whose precedence is at least `min_prec`.
+static void if_expr(IfValue *lhs, int min_prec) {
+    if_unary(lhs);
+
+    for (;;) {
+        Token *op = if_tok;
+        int prec = binary_prec(op);
+        if (prec < min_prec || prec == 0)
+            return;
+        if_next();
+
+        // && and || do not evaluate their right operand if the left
+        // one decides the result.
+        IfValue rhs;
+        if (prec <= 2) {
+            bool saved = if_skip;
+            bool is_and = (prec == 2);
+            if (is_and ? !lhs->val : lhs->val)
+                if_skip = true;
+            if_expr(&rhs, prec + 1);
+            if_skip = saved;
+            *lhs = (IfValue){is_and ? (lhs->val && rhs.val) : (lhs->val || rhs.val), false};
+            continue;
+        }
+
+        if_expr(&rhs, prec + 1);
+        if_binary(lhs, op, &rhs);
+    }
+}
+
+static void if_cond(IfValue *v) {
+    if_expr(v, 1);
+    if (!equal(if_tok, "?"))
+        return;
+
+    Token *start = if_tok;
+    bool saved = if_skip;
+    bool cond = v->val;
+
+    if_next();
+    if_skip = saved || !cond;
+    IfValue then;
+    if_cond(&then);
+
+    if (!equal(if_tok, ":"))
+        error_tok(start, "expected ':'");
+    if_next();
+    if_skip = saved || cond;
+    IfValue els;
+    if_cond(&els);
+    if_skip = saved;
+
+    *v = cond ? then : els;
+    v->is_unsigned = then.is_unsigned || els.is_unsigned;
+}
+
+// Read and evaluate a constant expression. The line is read through a
+// frame of its own that ends at the next line, so no tokens are copied.
+static long eval_const_expr(Token **rest, Token *tok) {
+    Frame *saved = frames;
+    frames = NULL;
+    push_file_frame(tok, NULL);
+    frames->line = true;
+    if_skip = false;
+
+    if_next();
+    IfValue v;
+    if_cond(&v);
+    if (if_tok->kind != TK_EOF)
+        error_tok(if_tok, "extra token");
+
+    *rest = frames->tok;
+    pop_frame();
+    frames = saved;
+    return v.val;
+}
+
 // Returns a new string "dir/file".
 static char *join_paths(char *dir, char *file) {
-    char *buf = malloc(strlen(dir) + strlen(file) + 2);
+    char *buf = arena_alloc(&token_arena, strlen(dir) + strlen(file) + 2);
     sprintf(buf, "%s/%s", dir, file);
     return buf;
 }
 
 // Returns true if a given file exists.
 static bool file_exists(char *path) {
+    include_stats.stats++;
     struct stat st;
     return !stat(path, &st);
 }
 
-static char *search_include_paths(char *filename, Token *start) {
-    // Search a file from the include paths.
-    for (char **p = include_paths; *p; p++) {
-        char *path = join_paths(*p, filename);
-        if (file_exists(path))
-            return path;
+static DirListing *get_dir_listing(int i) {
+    if (!dir_listings) {
+        int n = 0;
+        while (include_paths[n])
+            n++;
+        dir_listings = calloc(n, sizeof(DirListing));
+    }
+
+    DirListing *dl = &dir_listings[i];
+    if (dl->loaded)
+        return dl;
+    dl->loaded = true;
+
+    DIR *dir = opendir(include_paths[i]);
+    if (!dir) {
+        // A directory that does not exist contains nothing.
+        dl->listed = (errno == ENOENT);
+        return dl;
+    }
+
+    for (struct dirent *ent; (ent = readdir(dir));) {
+        char *name = arena_strndup(&pp_arena, ent->d_name, strlen(ent->d_name));
+        hashmap_put(&dl->names, name, (void *)1);
+    }
+    closedir(dir);
+    dl->listed = true;
+    return dl;
+}
+
+// Returns false if the i-th include directory certainly does not
+// contain a given file. Only the first component of the filename is
+// checked.
+static bool dir_may_contain(int i, char *filename) {
+    DirListing *dl = get_dir_listing(i);
+    if (!dl->listed)
+        return true;
+
+    char *slash = strchr(filename, '/');
+    int len = slash ? slash - filename : strlen(filename);
+    return hashmap_get2(&dl->names, filename, len);
+}
+
+// Searches a file in the include paths. A quoted filename is first
+// looked up relative to the current directory.
+static IncludePath *search_include_paths(char *filename, bool quoted) {
+    IncludePath *ip = arena_alloc(&pp_arena, sizeof(IncludePath));
+    long stats = include_stats.stats;
+
+    if (quoted && file_exists(filename)) {
+        ip->path = filename;
+    } else {
+        for (int i = 0; include_paths[i]; i++) {
+            if (!dir_may_contain(i, filename)) {
+                include_stats.stats_saved++;
+                continue;
+            }
+
+            char *path = join_paths(include_paths[i], filename);
+            if (file_exists(path)) {
+                ip->path = path;
+                break;
+            }
+        }
     }
-    error_tok(start, "'%s': file not found", filename);
+
+    ip->nstats = include_stats.stats - stats;
+    return ip;
 }
 
-// Read an #include argument.
-static char *read_include_path(Token **rest, Token *tok) {
+// Resolves an #include filename. Results, including failures, are
+// cached by spelling, because the search does not depend on the
+// location of the including file.
+static char *resolve_include(char *filename, bool quoted, Token *start) {
+    char *key = arena_alloc(&pp_arena, strlen(filename) + 2);
+    sprintf(key, "%c%s", quoted ? '"' : '<', filename);
+
+    IncludePath *ip = hashmap_get(&include_cache, key);
+    if (ip) {
+        include_stats.cache_hits++;
+        include_stats.stats_saved = include_stats.stats_saved + ip->nstats;
+    } else {
+        char *path = opt_prefetch_threads ? prefetched_include_path(filename, quoted) : NULL;
+        if (path) {
+            ip = arena_alloc(&pp_arena, sizeof(IncludePath));
+            ip->path = path;
+        } else {
+            ip = search_include_paths(filename, quoted);
+        }
+        hashmap_put(&include_cache, key, ip);
+    }
+
+    if (!ip->path)
+        error_tok(start, "'%s': file not found", filename);
+    return ip->path;
+}
+
+// Read an #include argument. `quoted` is set if the filename was
+// given in double quotes.
+static char *read_include_path(Token **rest, Token *tok, bool *quoted) {
     // Pattern 1: #include "foo.h"
     if (tok->kind == TK_STR) {
         // A double-quoted filename for #include is a special kind of
@@ -628,12 +1587,10 @@ static char *read_include_path(Token **rest, Token *tok) {
         // just two non-control characters, backslash and f.
         // So we don't want to use token->contents.
         Token *start = tok;
-        char *filename = strndup(tok->loc + 1, tok->len - 2);
+        char *filename = arena_strndup(&token_arena, tok->loc + 1, tok->len - 2);
         *rest = skip_line(tok->next);
-
-        if (file_exists(filename))
-            return filename;
-        return search_include_paths(filename, start);
+        *quoted = true;
+        return resolve_include(filename, true, start);
     }
 
     // Pattern 2: #include <foo.h>
@@ -643,13 +1600,14 @@ static char *read_include_path(Token **rest, Token *tok) {
         Token *start = tok;
 
         // Find closing ">".
-        for (; !equal(tok, ">"); tok = tok->next)
-            if (tok->kind == TK_EOF)
+        for (tok = tok->next; !equal(tok, ">"); tok = tok->next)
+            if (tok->at_bol)
                 error_tok(tok, "expected '>'");
 
         char *filename = join_tokens(start->next, tok);
         *rest = skip_line(tok->next);
-        return search_include_paths(filename, start);
+        *quoted = false;
+        return resolve_include(filename, false, start);
     }
 
     // Pattern 3: #include FOO
@@ -657,133 +1615,266 @@ static char *read_include_path(Token **rest, Token *tok) {
     // a single string token or a sequence of "<" ... ">".
     if (tok->kind == TK_IDENT) {
         Token *tok2 = preprocess(copy_line(rest, tok));
-        return read_include_path(&tok2, tok2);
+        return read_include_path(&tok2, tok2, quoted);
     }
 
     error_tok(tok, "expected a filename");
 }
 
-// Visit all tokens in `tok` while evaluating preprocessing
-// macros and directives.
-static Token *preprocess2(Token *tok) {
-    Token head = {};
-    Token *cur = &head;
+// Returns the FileInfo for a given path, or NULL if the file does not
+// exist. Each path is looked up with stat() only once.
+static FileInfo *get_file_info(char *path) {
+    FileInfo *fi = hashmap_get(&files_by_path, path);
+    if (fi)
+        return fi;
 
-    while (tok->kind != TK_EOF) {
-        // If it is a macro, expand it.
-        if (expand_macro(&tok, tok))
-            continue;
+    struct stat st;
+    if (stat(path, &st))
+        return NULL;
 
-        // Pass through if it is not a "#".
-        if (!is_hash(tok)) {
-            cur = cur->next = tok;
-            tok = tok->next;
-            continue;
-        }
+    FileId id = {st.st_dev, st.st_ino};
+    fi = hashmap_get2(&files, (char *)&id, sizeof(id));
+    if (!fi) {
+        fi = arena_alloc(&pp_arena, sizeof(FileInfo));
+        fi->id = id;
+        fi->path = path;
+        fi->size = st.st_size;
+        hashmap_put2(&files, (char *)&fi->id, sizeof(fi->id), fi);
+    }
+    hashmap_put(&files_by_path, path, fi);
+    return fi;
+}
 
-        Token *start = tok;
-        tok = tok->next;
+// Records a file read by #include for -M and -MD.
+static void add_dependency(char *path, FileInfo *fi, bool is_system) {
+    Dependency *dep = arena_alloc(&pp_arena, sizeof(Dependency));
+    dep->path = path;
+    dep->is_system = is_system;
+    *last_dependency = dep;
+    last_dependency = &dep->next;
+    fi->is_dependency = true;
+    fi->is_system = is_system;
+}
 
-        if (equal(tok, "include")) {
-            char *path = read_include_path(&tok, tok->next);
-            Token *tok2 = tokenize_file(path);
-            if (!tok2)
-                error_tok(tok, "%s", strerror(errno));
-            tok = append(tok2, tok);
-            continue;
+// Evaluates a directive starting with `start`, which is a "#" read
+// from the file frame on top of the stack, and returns the tokens
+// that follow it. #include pushes a frame for the included file.
+//
+// A file whose contents are entirely enclosed in an include guard
+// like the following is detected while its directives are evaluated.
+// Once such a file has been included, including it again has no
+// effect as long as the macro is defined.
+//
+//   #ifndef FOO_H
+//   #define FOO_H
+//   ...
+//   #endif
+static Token *directive(Token *start) {
+    Frame *f = frames;
+    Token *tok = start->next;
+
+    if (equal(tok, "include")) {
+        bool quoted;
+        char *path = read_include_path(&tok, tok->next, &quoted);
+
+        FileInfo *fi = get_file_info(path);
+        if (fi && !fi->is_dependency)
+            add_dependency(path, fi, !quoted || (f->file && f->file->is_system));
+        if (fi && (fi->pragma_once || (fi->guard && lookup_macro(fi->guard)))) {
+            fi->skipped++;
+            return tok;
         }
 
-        if (equal(tok, "define")) {
-            read_macro_definition(&tok, tok->next);
-            continue;
+        long start_nsec = opt_pp_stats ? now_nsec() : 0;
+        long ntokens = tokenize_stats.tokens;
+        Token *tok2 = tokenize_file(path);
+        if (!tok2)
+            error_tok(tok, "%s", strerror(errno));
+
+        push_file_frame(tok2, fi);
+        if (fi) {
+            fi->included++;
+            fi->tokens = fi->tokens + tokenize_stats.tokens - ntokens;
+            frames->start_nsec = start_nsec;
         }
+        if (file_hook)
+            file_hook(tok2, 1);
+        return tok;
+    }
 
-        if (equal(tok, "undef")) {
-            tok = tok->next;
-            if (tok->kind != TK_IDENT)
-                error_tok(tok, "macro name must be an identifier");
-            char *name = strndup(tok->loc, tok->len);
-            tok = skip_line(tok->next);
+    if (equal(tok, "define")) {
+        Token *name = tok->next;
+        read_macro_definition(&tok, tok->next);
+        if (start == f->guard_define && name->u.atom == f->guard)
+            f->guard_defined = true;
+        return tok;
+    }
 
-            Macro *m = add_macro(name, true, NULL);
-            m->deleted = true;
-            continue;
-        }
+    if (equal(tok, "undef")) {
+        tok = tok->next;
+        if (tok->kind != TK_IDENT)
+            error_tok(tok, "macro name must be an identifier");
+        undef_macro(tok->u.atom);
+        return skip_line(tok->next);
+    }
 
-        if (equal(tok, "if")) {
-            long val = eval_const_expr(&tok, tok->next);
-            push_cond_incl(start, val);
-            if (!val)
-                tok = skip_cond_incl(tok);
-            continue;
-        }
+    if (equal(tok, "if")) {
+        long val = eval_const_expr(&tok, tok->next);
+        push_cond_incl(start, val);
+        if (!val)
+            tok = skip_cond_incl(tok);
+        return tok;
+    }
 
-        if (equal(tok, "ifdef")) {
-            bool defined = find_macro(tok->next);
-            push_cond_incl(tok, defined);
-            tok = skip_line(tok->next->next);
-            if (!defined)
-                tok = skip_cond_incl(tok);
-            continue;
+    if (equal(tok, "ifdef")) {
+        bool defined = find_macro(tok->next);
+        push_cond_incl(tok, defined);
+        tok = skip_line(tok->next->next);
+        if (!defined)
+            tok = skip_cond_incl(tok);
+        return tok;
+    }
+
+    if (equal(tok, "ifndef")) {
+        bool defined = find_macro(tok->next);
+        CondIncl *ci = push_cond_incl(tok, !defined);
+        if (start == f->first && tok->next->kind == TK_IDENT) {
+            f->guard = tok->next->u.atom;
+            f->guard_cond = ci;
         }
 
-        if (equal(tok, "ifndef")) {
-            bool defined = find_macro(tok->next);
-            push_cond_incl(tok, !defined);
-            tok = skip_line(tok->next->next);
-            if (defined)
-                tok = skip_cond_incl(tok);
-            continue;
+        tok = skip_line(tok->next->next);
+        if (f->guard_cond == ci)
+            f->guard_define = tok;
+        if (defined)
+            tok = skip_cond_incl(tok);
+        return tok;
+    }
+
+    if (equal(tok, "elif")) {
+        if (!cond_incl || cond_incl->ctx == IN_ELSE)
+            error_tok(start, "stray #elif");
+        cond_incl->ctx = IN_ELIF;
+
+        // A guard with another branch does not enclose the whole file.
+        if (cond_incl == f->guard_cond)
+            f->guard_cond = NULL;
+
+        if (!cond_incl->included && eval_const_expr(&tok, tok->next)) {
+            cond_incl->included = true;
+            return tok;
         }
+        return skip_cond_incl(tok);
+    }
 
-        if (equal(tok, "elif")) {
-            if (!cond_incl || cond_incl->ctx == IN_ELSE)
-                error_tok(start, "stray #elif");
-            cond_incl->ctx = IN_ELIF;
+    if (equal(tok, "else")) {
+        if (!cond_incl || cond_incl->ctx == IN_ELSE)
+            error_tok(start, "stray #else");
+        cond_incl->ctx = IN_ELSE;
+        tok = skip_line(tok->next);
 
-            if (!cond_incl->included && eval_const_expr(&tok, tok->next))
-                cond_incl->included = true;
-            else
-                tok = skip_cond_incl(tok->next);
-            continue;
+        if (cond_incl == f->guard_cond)
+            f->guard_cond = NULL;
+
+        if (cond_incl->included)
+            tok = skip_cond_incl(tok);
+        return tok;
+    }
+
+    if (equal(tok, "endif")) {
+        if (!cond_incl)
+            error_tok(start, "stray #endif");
+        CondIncl *ci = cond_incl;
+        cond_incl = ci->next;
+        tok = skip_line(tok->next);
+
+        if (ci == f->guard_cond && f->guard_defined && tok->kind == TK_EOF && f->file)
+            f->file->guard = f->guard;
+        return tok;
+    }
+
+    if (equal(tok, "pragma")) {
+        // #pragma once in the main file is ignored.
+        if (equal(tok->next, "once") && frames->file) {
+            frames->file->pragma_once = true;
+            return skip_line(tok->next->next);
         }
 
-        if (equal(tok, "else")) {
-            if (!cond_incl || cond_incl->ctx == IN_ELSE)
-                error_tok(start, "stray #else");
-            cond_incl->ctx = IN_ELSE;
-            tok = skip_line(tok->next);
+        // Other pragmas are ignored.
+        do {
+            tok = tok->next;
+        } while (!tok->at_bol);
+        return tok;
+    }
+
+    if (equal(tok, "error"))
+        error_tok(tok, "");
 
-            if (cond_incl->included)
-                tok = skip_cond_incl(tok);
+    // `#`-only line is legal. It's called a null directive.
+    if (tok->at_bol)
+        return tok;
+
+    error_tok(tok, "invalid preprocessor directive");
+}
+
+// Returns the next output token, expanding macros and evaluating
+// directives on the way. `origin` is set to the token in a file that
+// the output token stands for: the token itself if it was read from a
+// file, or the outermost macro invocation that produced it.
+static Token *read_token(Token **origin) {
+    for (;;) {
+        Token *tok = next_token();
+        if (token_from_file)
+            last_origin = tok;
+        if (tok->kind == TK_EOF)
+            return tok;
+
+        // If it is a macro, expand it.
+        if (expand_macro(tok))
             continue;
-        }
 
-        if (equal(tok, "endif")) {
-            if (!cond_incl)
-                error_tok(start, "stray #endif");
-            cond_incl = cond_incl->next;
-            tok = skip_line(tok->next);
+        // Directives are recognized only in files, not in the results
+        // of macro expansion.
+        if (token_from_file && is_hash(tok)) {
+            Frame *f = frames;
+            f->tok = directive(tok);
             continue;
         }
 
-        if (equal(tok, "error"))
-            error_tok(tok, "");
+        *origin = last_origin;
+        return tok;
+    }
+}
 
-        // `#`-only line is legal. It's called a null directive.
-        if (tok->at_bol)
-            continue;
+// Visit all tokens in `tok` while evaluating preprocessing
+// macros and directives.
+static Token *preprocess2(Token *tok) {
+    // This function is reentered to evaluate computed #include, so it
+    // runs on its own frame stack.
+    Frame *saved = frames;
+    frames = NULL;
+    push_file_frame(tok, NULL);
 
-        error_tok(tok, "invalid preprocessor directive");
+    Token head = {};
+    Token *cur = &head;
+    Token *origin;
+
+    for (;;) {
+        tok = read_token(&origin);
+        if (tok->kind == TK_EOF)
+            break;
+        cur = cur->next = tok;
     }
 
     cur->next = tok;
+    pop_frame();
+    frames = saved;
     return head.next;
 }
 
 void define_macro(char *name, char *buf) {
-    Token *tok = tokenize("(internal)", 1, buf);
-    add_macro(name, true, tok);
+    Token *tok = tokenize(new_file("(internal)", 1, buf));
+    add_macro(intern(name, strlen(name)), true, tok);
 }
 
 void init_macros(void) {
@@ -831,28 +1922,40 @@ void init_macros(void) {
     define_macro("__typeof__", "typeof");
     define_macro("__volatile__", "volatile");
 
-    file_macro = add_macro("__FILE__", true, NULL);
-    line_macro = add_macro("__LINE__", true, NULL);
-}
-
-// Concatenate two string literals
-static Token *join_strings(Token *t1, Token *t2) {
-    char *buf = malloc(t1->len + t2->len - 1);
-    sprintf(buf, "%.*s%.*s", t1->len - 1, t1->loc, t2->len - 1, t2->loc + 1);
-    return tokenize(t1->filename, t1->file_no, buf);
+    file_macro = add_macro(intern("__FILE__", 8), true, NULL);
+    line_macro = add_macro(intern("__LINE__", 8), true, NULL);
 }
 
 // Concatenate adjacent string literals into a single string literal
-// as per the C spec.
+// as per the C spec. Each run of literals is joined at once from their
+// decoded contents, so escape sequences are never combined across
+// literals and the result is not tokenized again. The joined literal
+// keeps the location of the first one.
 static void join_adjacent_string_literals(Token *tok) {
-    while (tok) {
-        if (tok->kind == TK_STR && tok->next && tok->next->kind == TK_STR) {
-            Token *next = tok->next->next;
-            *tok = *join_strings(tok, tok->next);
-            tok->next = next;
-        } else {
-            tok = tok->next;
+    for (; tok; tok = tok->next) {
+        if (tok->kind != TK_STR || !tok->next || tok->next->kind != TK_STR)
+            continue;
+
+        Token *end = tok;
+        int len = 1;
+        for (; end->kind == TK_STR; end = end->next)
+            len += end->u.lit->cont_len - 1;
+
+        char *buf = arena_alloc(&token_arena, len);
+        int pos = 0;
+        for (Token *t = tok; t != end; t = t->next) {
+            memcpy(buf + pos, t->u.lit->contents, t->u.lit->cont_len - 1);
+            pos += t->u.lit->cont_len - 1;
         }
+        buf[pos] = '\0';
+
+        // The literal may be shared with a macro body.
+        Literal *lit = arena_alloc(&token_arena, sizeof(Literal));
+        *lit = *tok->u.lit;
+        lit->contents = buf;
+        lit->cont_len = len;
+        tok->u.lit = lit;
+        tok->next = end;
     }
 }
 
@@ -864,4 +1967,218 @@ Token *preprocess(Token *tok) {
     convert_pp_tokens(tok);
     join_adjacent_string_literals(tok);
     return tok;
-}
\ No newline at end of file
+}
+
+// Preprocesses `tok` and passes each output token to `emit` as soon as
+// it is produced, along with its origin (see read_token). `enter_file`
+// is called with flag 1 when an included file is entered and with flag
+// 2 when the including file is returned to, and once with flag 0 at the
+// start. This is used by -E, so the output is never collected into a
+// list, and string literals are left as they are.
+void preprocess_stream(Token *tok, void (*emit)(Token *tok, Token *origin),
+                       void (*enter_file)(Token *tok, int flag)) {
+    push_file_frame(tok, NULL);
+    file_hook = enter_file;
+    if (enter_file)
+        enter_file(tok, 0);
+
+    for (;;) {
+        Token *origin;
+        tok = read_token(&origin);
+        if (tok->kind == TK_EOF)
+            break;
+        emit(tok, origin);
+    }
+
+    file_hook = NULL;
+    pop_frame();
+    if (cond_incl)
+        error_tok(cond_incl->tok, "unterminated conditional directive");
+}
+
+static int compare_macros(const void *a, const void *b) {
+    Macro *x = *(Macro **)a;
+    Macro *y = *(Macro **)b;
+    if (x->tokens != y->tokens)
+        return (x->tokens < y->tokens) ? 1 : -1;
+    if (x->expansions != y->expansions)
+        return (x->expansions < y->expansions) ? 1 : -1;
+    return strcmp(x->name->name, y->name->name);
+}
+
+static int compare_files(const void *a, const void *b) {
+    FileInfo *x = *(FileInfo **)a;
+    FileInfo *y = *(FileInfo **)b;
+    if (x->nsec != y->nsec)
+        return (x->nsec < y->nsec) ? 1 : -1;
+    return strcmp(x->path, y->path);
+}
+
+static void print_json_string(char *s) {
+    fputc('"', stderr);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(stderr, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(stderr, "\\u%04x", *s);
+        else
+            fputc(*s, stderr);
+    }
+    fputc('"', stderr);
+}
+
+// Prints the report of -fpp-stats to stderr: every macro that was
+// expanded, including one that was later undefined or redefined,
+// sorted by the number of tokens its expansions produced, and every
+// included file, sorted by the time spent in it. The time of a file
+// includes the files it includes. Tokens are counted as they are read
+// from a macro body or argument, before they are rescanned. The
+// report must be printed before pp_arena is released.
+void print_pp_stats(bool json) {
+    Macro **ms = calloc(nexpanded + 1, sizeof(Macro *));
+    int nmacros = 0;
+    for (Macro *m = expanded_macros; m; m = m->next_expanded)
+        ms[nmacros++] = m;
+    qsort(ms, nmacros, sizeof(Macro *), compare_macros);
+
+    FileInfo **fs = calloc(files.used + 1, sizeof(FileInfo *));
+    int nfiles = 0;
+    for (int i = 0; i < files.capacity; i++) {
+        FileInfo *fi = files.buckets[i].val;
+        if (files.buckets[i].key && (fi->included || fi->skipped))
+            fs[nfiles++] = fi;
+    }
+    qsort(fs, nfiles, sizeof(FileInfo *), compare_files);
+
+    if (json) {
+        fprintf(stderr, "{\"macros\": [");
+        for (int i = 0; i < nmacros; i++)
+            fprintf(stderr, "%s\n  {\"name\": \"%s\", \"expansions\": %ld, \"tokens\": %ld}",
+                    i ? "," : "", ms[i]->name->name, ms[i]->expansions, ms[i]->tokens);
+        fprintf(stderr, "],\n\"files\": [");
+        for (int i = 0; i < nfiles; i++) {
+            FileInfo *fi = fs[i];
+            fprintf(stderr, "%s\n  {\"path\": ", i ? "," : "");
+            print_json_string(fi->path);
+            fprintf(stderr, ", \"included\": %ld, \"skipped\": %ld, \"bytes\": %ld, ",
+                    fi->included, fi->skipped, fi->size * fi->included);
+            fprintf(stderr, "\"tokens\": %ld, \"nsec\": %ld}", fi->tokens, fi->nsec);
+        }
+        fprintf(stderr, "]}\n");
+    } else {
+        fprintf(stderr, "%10s %10s  %s\n", "expansions", "tokens", "macro");
+        for (int i = 0; i < nmacros; i++)
+            fprintf(stderr, "%10ld %10ld  %s\n",
+                    ms[i]->expansions, ms[i]->tokens, ms[i]->name->name);
+
+        fprintf(stderr, "\n%8s %8s %10s ", "included", "skipped", "bytes");
+        fprintf(stderr, "%10s %10s  %s\n", "tokens", "ms", "file");
+        for (int i = 0; i < nfiles; i++) {
+            FileInfo *fi = fs[i];
+            fprintf(stderr, "%8ld %8ld %10ld ",
+                    fi->included, fi->skipped, fi->size * fi->included);
+            fprintf(stderr, "%10ld %10.3f  %s\n", fi->tokens, fi->nsec / 1e6, fi->path);
+        }
+    }
+
+    free(ms);
+    free(fs);
+}
+
+static int write_macro_param(PchWriter *w, void *p) {
+    MacroParam *mp = p;
+    int off = pch_copy(w, mp, sizeof(MacroParam));
+    pch_atom(w, off + offsetof(MacroParam, name), mp->name);
+    return off;
+}
+
+static int write_macro(PchWriter *w, Macro *m) {
+    int off = pch_copy(w, m, sizeof(Macro));
+    pch_atom(w, off + offsetof(Macro, name), m->name);
+    pch_ptr(w, off + offsetof(Macro, params),
+            pch_list(w, m->params, offsetof(MacroParam, next), write_macro_param));
+    pch_ptr(w, off + offsetof(Macro, body), pch_token_list(w, m->body));
+
+    pch_ptr(w, off + offsetof(Macro, next_expanded), 0);
+    pch_ptr(w, off + offsetof(Macro, expansion), 0);
+    pch_ptr(w, off + offsetof(Macro, deps), 0);
+
+    Macro *copy = pch_at(w, off);
+    copy->expansions = copy->tokens = 0;
+    copy->memo_gen = 0;
+    copy->ndeps = 0;
+    return off;
+}
+
+static int write_file_info(PchWriter *w, FileInfo *fi) {
+    int off = pch_copy(w, fi, sizeof(FileInfo));
+    pch_ptr(w, off + offsetof(FileInfo, path), pch_string(w, fi->path));
+    pch_atom(w, off + offsetof(FileInfo, guard), fi->guard);
+    return off;
+}
+
+static int write_dependency(PchWriter *w, void *p) {
+    Dependency *dep = p;
+    int off = pch_copy(w, dep, sizeof(Dependency));
+    pch_ptr(w, off + offsetof(Dependency, path), pch_string(w, dep->path));
+    return off;
+}
+
+// Writes the macro table, the files that are skipped by their include
+// guards or #pragma once, and the dependencies to a precompiled header.
+// __FILE__ and __LINE__ are built in and are not written. The header
+// itself is treated as if it had #pragma once, so that including it
+// after loading the precompiled header has no effect.
+void write_pch_macros(PchWriter *w, char *header) {
+    FileInfo *header_fi = get_file_info(header);
+    if (header_fi) {
+        header_fi->pragma_once = true;
+        if (!header_fi->is_dependency)
+            add_dependency(header, header_fi, false);
+    }
+
+    int arr = pch_alloc(w, sizeof(Macro *) * (macros.used + 1));
+    int n = 0;
+    for (int i = 0; i < macros.capacity; i++) {
+        Macro *m = macros.slots[i];
+        if (m && m != file_macro && m != line_macro)
+            pch_ptr(w, arr + sizeof(Macro *) * n++, write_macro(w, m));
+    }
+    pch_set_root(w, PCH_MACROS, arr);
+
+    arr = pch_alloc(w, sizeof(FileInfo *) * (files.used + 1));
+    n = 0;
+    for (int i = 0; i < files.capacity; i++) {
+        FileInfo *fi = files.buckets[i].val;
+        if (files.buckets[i].key && (fi->pragma_once || fi->guard))
+            pch_ptr(w, arr + sizeof(FileInfo *) * n++, write_file_info(w, fi));
+    }
+    pch_set_root(w, PCH_FILE_INFOS, arr);
+
+    pch_set_root(w, PCH_DEPENDENCIES,
+                 pch_list(w, dependencies, offsetof(Dependency, next), write_dependency));
+}
+
+// Restores the state written by write_pch_macros. Macros of the
+// precompiled header replace those defined on the command line.
+void read_pch_macros(Pch *pch) {
+    for (Macro **m = pch_root(pch, PCH_MACROS); *m; m++)
+        insert_macro(*m);
+
+    // Files are looked up again since they are identified by their
+    // device and inode numbers.
+    for (FileInfo **p = pch_root(pch, PCH_FILE_INFOS); *p; p++) {
+        FileInfo *fi = get_file_info((*p)->path);
+        if (!fi)
+            continue;
+        fi->pragma_once |= (*p)->pragma_once;
+        if ((*p)->guard)
+            fi->guard = (*p)->guard;
+    }
+
+    for (Dependency *dep = pch_root(pch, PCH_DEPENDENCIES); dep; dep = dep->next) {
+        FileInfo *fi = get_file_info(dep->path);
+        if (fi && !fi->is_dependency)
+            add_dependency(dep->path, fi, dep->is_system);
+    }
+}
@@ -0,0 +1,337 @@
+#include "nsc.h"
+
+// The token cache saves the token stream of each source file to a
+// directory given by -ftoken-cache=DIR so that later compilations can
+// load it instead of scanning the file again.
+//
+// A cache entry is a single file that is mapped into memory as is.
+// It consists of a header, the path of the source file, its line-start
+// index, a table of the distinct identifiers in the file, an array of
+// fixed-size token records and a pool holding identifier names,
+// literal contents and the spellings of spliced tokens. Tokens refer
+// to the source file and the pool by offset and to identifiers by
+// index, so each identifier is interned once per file when loading.
+//
+// An entry is valid if the size and the modification time of the
+// source file are the same as when the entry was written. If only the
+// modification time differs, the entry is still used as long as the
+// hash of the file contents matches.
+
+#define CACHE_MAGIC "nsctok1"
+
+typedef struct {
+    char magic[8];
+    long size;         // Size of the source file
+    long mtime_sec;    // Modification time of the source file
+    long mtime_nsec;
+    unsigned int hash; // Hash of the source file contents
+    int path_len;
+    int nlines;
+    int nidents;
+    int ntokens;
+    int pool_len;
+} CacheHeader;
+
+enum {
+    CT_AT_BOL = 1,
+    CT_HAS_SPACE = 2,
+    CT_SPLICED = 4,  // The spelling is in the pool
+};
+
+typedef struct {
+    int name;          // Offset in the pool
+    int len;
+    unsigned int hash;
+} CachedIdent;
+
+typedef struct {
+    int loc;           // Offset in the source file or in the pool
+    int len;
+    unsigned int aux;  // Index of an identifier, value of a char
+                       // literal or pool offset of string contents
+    int aux2;          // Length of string contents
+    int line_delta;    // Line offset of a spliced token
+    char kind;
+    char flags;
+} CachedToken;
+
+// The line-start index of every spliced token
+static int zero_line_start;
+
+// Returns the name of the cache entry for a given source file.
+static char *entry_path(char *path) {
+    static char *cwd;
+    if (!cwd) {
+        cwd = getcwd(NULL, 0);
+        if (!cwd)
+            cwd = "";
+    }
+
+    // Relative paths are keyed by their absolute paths so that an
+    // entry can be shared by compilations in different directories.
+    char *abs = path;
+    if (path[0] != '/') {
+        abs = arena_alloc(&token_arena, strlen(cwd) + strlen(path) + 2);
+        sprintf(abs, "%s/%s", cwd, path);
+    }
+
+    char *buf = arena_alloc(&token_arena, strlen(opt_token_cache) + 20);
+    sprintf(buf, "%s/%08x.tok", opt_token_cache,
+            hash_string(abs, strlen(abs)));
+    return buf;
+}
+
+static int align8(int n) {
+    return (n + 7) & ~7;
+}
+
+// Maps the cache entry for a given file. Returns NULL if there is
+// no entry or the entry is not valid for the file.
+static CacheHeader *map_entry(File *file, struct stat *st) {
+    int fd = open(entry_path(file->name), O_RDONLY);
+    if (fd == -1)
+        return NULL;
+
+    struct stat est;
+    if (fstat(fd, &est) == -1 || est.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    char *map = mmap(NULL, est.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    CacheHeader *hdr = (CacheHeader *)map;
+    bool valid =
+        !memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) &&
+        est.st_size == sizeof(CacheHeader) + align8(hdr->path_len) +
+                           align8(sizeof(int) * hdr->nlines) +
+                           align8(sizeof(CachedIdent) * hdr->nidents) +
+                           sizeof(CachedToken) * hdr->ntokens + hdr->pool_len &&
+        hdr->size == st->st_size &&
+        hdr->path_len == strlen(file->name) &&
+        !memcmp(map + sizeof(CacheHeader), file->name, hdr->path_len);
+
+    if (valid && (hdr->mtime_sec != st->st_mtim.tv_sec ||
+                  hdr->mtime_nsec != st->st_mtim.tv_nsec))
+        valid = (hdr->hash == hash_string(file->contents, st->st_size));
+
+    if (!valid) {
+        munmap(map, est.st_size);
+        return NULL;
+    }
+    return hdr;
+}
+
+// Returns the tokens of a given file from the cache, or NULL if the
+// cache does not have a valid entry for the file.
+Token *load_cached_tokens(File *file, struct stat *st) {
+    CacheHeader *hdr = map_entry(file, st);
+    if (!hdr) {
+        if (opt_stats)
+            tokenize_stats.cache_misses++;
+        return NULL;
+    }
+
+    char *p = (char *)(hdr + 1) + align8(hdr->path_len);
+    int *line_starts = (int *)p;
+    p += align8(sizeof(int) * hdr->nlines);
+    CachedIdent *cidents = (CachedIdent *)p;
+    p += align8(sizeof(CachedIdent) * hdr->nidents);
+    CachedToken *ctoks = (CachedToken *)p;
+    char *pool = (char *)(ctoks + hdr->ntokens);
+
+    file->line_starts = line_starts;
+    file->nlines = hdr->nlines;
+
+    Atom **atoms = malloc(sizeof(Atom *) * hdr->nidents);
+    for (int i = 0; i < hdr->nidents; i++) {
+        CachedIdent *ci = &cidents[i];
+        atoms[i] = intern2(pool + ci->name, ci->len, ci->hash);
+    }
+
+    Token *toks = arena_alloc(&token_arena, sizeof(Token) * hdr->ntokens);
+
+    for (int i = 0; i < hdr->ntokens; i++) {
+        CachedToken *ct = &ctoks[i];
+        Token *tok = &toks[i];
+        tok->kind = ct->kind;
+        tok->len = ct->len;
+        tok->at_bol = ct->flags & CT_AT_BOL;
+        tok->has_space = ct->flags & CT_HAS_SPACE;
+
+        if (ct->flags & CT_SPLICED) {
+            File *f = new_file(file->name, file->file_no, pool + ct->loc);
+            f->line_delta = ct->line_delta;
+            f->line_starts = &zero_line_start;
+            f->nlines = 1;
+            tok->loc = f->contents;
+            tok->file_id = f->id;
+        } else {
+            tok->loc = file->contents + ct->loc;
+            tok->file_id = file->id;
+        }
+
+        switch (tok->kind) {
+            case TK_IDENT:
+                tok->u.atom = atoms[ct->aux];
+                break;
+            case TK_STR:
+                tok->u.lit = arena_alloc(&token_arena, sizeof(Literal));
+                tok->u.lit->contents = pool + ct->aux;
+                tok->u.lit->cont_len = ct->aux2;
+                break;
+            case TK_NUM:
+                tok->u.lit = arena_alloc(&token_arena, sizeof(Literal));
+                tok->u.lit->val = (int)ct->aux;
+                tok->u.lit->ty = ty_int;
+                break;
+        }
+
+        if (i + 1 < hdr->ntokens)
+            tok->next = tok + 1;
+    }
+    free(atoms);
+
+    tokenize_stats.tokens = tokenize_stats.tokens + hdr->ntokens - 1;
+    if (opt_stats) {
+        tokenize_stats.cache_hits++;
+        tokenize_stats.bytes = tokenize_stats.bytes + st->st_size;
+    }
+    return toks;
+}
+
+// A growable buffer for building the pool of a cache entry
+typedef struct {
+    char *buf;
+    int len;
+    int cap;
+} Pool;
+
+// Appends `n` bytes to the pool and returns their offset.
+static int add_to_pool(Pool *pool, char *p, int n) {
+    while (pool->len + n > pool->cap) {
+        pool->cap = pool->cap ? pool->cap * 2 : 4096;
+        pool->buf = realloc(pool->buf, pool->cap);
+    }
+    memcpy(pool->buf + pool->len, p, n);
+    int off = pool->len;
+    pool->len += n;
+    return off;
+}
+
+// Writes the tokens of a given file to the cache. The entry is
+// written to a temporary file first and then renamed so that
+// concurrent compilations never see a partially-written entry.
+void store_cached_tokens(File *file, struct stat *st, Token *tok) {
+    int ntokens = 0;
+    for (Token *t = tok; t; t = t->next)
+        ntokens++;
+
+    CachedToken *ctoks = calloc(ntokens, sizeof(CachedToken));
+    Pool pool = {};
+
+    // The identifier table. `slots` is an open-addressing hash table
+    // that maps atoms to their indices plus one.
+    CachedIdent *cidents = calloc(ntokens, sizeof(CachedIdent));
+    Atom **atoms = calloc(ntokens, sizeof(Atom *));
+    int nidents = 0;
+    int cap = 16;
+    while (cap < ntokens * 2)
+        cap *= 2;
+    int *slots = calloc(cap, sizeof(int));
+
+    int i = 0;
+    for (Token *t = tok; t; t = t->next, i++) {
+        CachedToken *ct = &ctoks[i];
+        ct->kind = t->kind;
+        ct->len = t->len;
+        ct->flags = (t->at_bol ? CT_AT_BOL : 0) | (t->has_space ? CT_HAS_SPACE : 0);
+
+        if (t->file_id == file->id) {
+            ct->loc = t->loc - file->contents;
+        } else {
+            // The token was read from a scratch copy because it
+            // contains a backslash-newline.
+            ct->flags |= CT_SPLICED;
+            ct->loc = add_to_pool(&pool, t->loc, t->len);
+            add_to_pool(&pool, "", 1);
+            ct->line_delta = get_line_no(t) - 1;
+        }
+
+        switch (t->kind) {
+            case TK_IDENT: {
+                Atom *a = t->u.atom;
+                int j = a->hash & (cap - 1);
+                while (slots[j] && atoms[slots[j] - 1] != a)
+                    j = (j + 1) & (cap - 1);
+
+                if (!slots[j]) {
+                    CachedIdent *ci = &cidents[nidents];
+                    ci->name = add_to_pool(&pool, a->name, a->len);
+                    ci->len = a->len;
+                    ci->hash = a->hash;
+                    atoms[nidents] = a;
+                    slots[j] = ++nidents;
+                }
+                ct->aux = slots[j] - 1;
+                break;
+            }
+            case TK_STR:
+                ct->aux = add_to_pool(&pool, t->u.lit->contents, t->u.lit->cont_len);
+                ct->aux2 = t->u.lit->cont_len;
+                break;
+            case TK_NUM:
+                ct->aux = t->u.lit->val;
+                break;
+        }
+    }
+
+    CacheHeader hdr = {};
+    memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.size = st->st_size;
+    hdr.mtime_sec = st->st_mtim.tv_sec;
+    hdr.mtime_nsec = st->st_mtim.tv_nsec;
+    hdr.hash = hash_string(file->contents, st->st_size);
+    hdr.path_len = strlen(file->name);
+    hdr.nlines = file->nlines;
+    hdr.nidents = nidents;
+    hdr.ntokens = ntokens;
+    hdr.pool_len = pool.len;
+
+    mkdir(opt_token_cache, 0777);
+
+    char *path = entry_path(file->name);
+    char *tmp = arena_alloc(&token_arena, strlen(path) + 20);
+    sprintf(tmp, "%s.%d", path, getpid());
+
+    FILE *fp = fopen(tmp, "w");
+    if (fp) {
+        static char zero[8];
+        int lines_size = sizeof(int) * file->nlines;
+        int idents_size = sizeof(CachedIdent) * nidents;
+
+        fwrite(&hdr, sizeof(hdr), 1, fp);
+        fwrite(file->name, 1, hdr.path_len, fp);
+        fwrite(zero, 1, align8(hdr.path_len) - hdr.path_len, fp);
+        fwrite(file->line_starts, 1, lines_size, fp);
+        fwrite(zero, 1, align8(lines_size) - lines_size, fp);
+        fwrite(cidents, 1, idents_size, fp);
+        fwrite(zero, 1, align8(idents_size) - idents_size, fp);
+        fwrite(ctoks, sizeof(CachedToken), ntokens, fp);
+        fwrite(pool.buf, 1, pool.len, fp);
+
+        if (fclose(fp) == 0)
+            rename(tmp, path);
+        else
+            unlink(tmp);
+    }
+
+    free(ctoks);
+    free(cidents);
+    free(atoms);
+    free(slots);
+    free(pool.buf);
+}
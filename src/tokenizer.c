@@ -1,10 +1,86 @@
 #include "nsc.h"
 
-// Input filename
-static char *current_filename;
+#ifdef __SSE2__
+#include <immintrin.h>
+#include <stdint.h>
+#endif
+
+TokenizeStats tokenize_stats;
+
+// Input file
+static File *current_file;
+
+// Position info for the next token
+static bool at_bol;
+static bool has_space;
+
+// Capacity of current_file->line_starts
+static int line_starts_capacity;
+
+// The file table. Tokens refer to their files by index.
+static File **files;
+static int files_len;
+static int files_capacity;
+
+// The atom table is a chained hash table whose number of buckets is
+// always a power of two.
+static Atom **atoms;
+static int atoms_capacity;
+static int atoms_used;
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+
+// Returns the FNV-1a hash of a given string.
+unsigned int hash_string(char *s, int len) {
+    unsigned int hash = FNV_OFFSET;
+    for (int i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char)s[i]) * FNV_PRIME;
+    return hash;
+}
+
+static void rehash_atoms(void) {
+    int cap = atoms_capacity ? atoms_capacity * 2 : 4096;
+    Atom **buckets = calloc(cap, sizeof(Atom *));
+
+    for (int i = 0; i < atoms_capacity; i++) {
+        Atom *next;
+        for (Atom *a = atoms[i]; a; a = next) {
+            next = a->next;
+            a->next = buckets[a->hash & (cap - 1)];
+            buckets[a->hash & (cap - 1)] = a;
+        }
+    }
 
-// Input string
-static char *current_input;
+    free(atoms);
+    atoms = buckets;
+    atoms_capacity = cap;
+}
+
+// Returns the atom for a given string whose hash value has already
+// been computed. A new atom is created if it has not been seen yet.
+Atom *intern2(char *name, int len, unsigned int hash) {
+    if (atoms_used >= atoms_capacity)
+        rehash_atoms();
+
+    Atom **bucket = &atoms[hash & (atoms_capacity - 1)];
+    for (Atom *a = *bucket; a; a = a->next)
+        if (a->hash == hash && a->len == len && !memcmp(a->name, name, len))
+            return a;
+
+    Atom *a = arena_alloc(&token_arena, sizeof(Atom));
+    a->name = arena_strndup(&token_arena, name, len);
+    a->len = len;
+    a->hash = hash;
+    a->next = *bucket;
+    *bucket = a;
+    atoms_used++;
+    return a;
+}
+
+Atom *intern(char *name, int len) {
+    return intern2(name, len, hash_string(name, len));
+}
 
 // Reports an error and exit.
 void error(char *fmt, ...) {
@@ -15,6 +91,22 @@ void error(char *fmt, ...) {
     exit(1);
 }
 
+// Returns the line number of `loc` in a given file by binary search
+// over the file's line-start index.
+static int find_line_no(File *file, char *loc) {
+    int offset = loc - file->contents;
+    int lo = 0;
+    int hi = file->nlines - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (file->line_starts[mid] <= offset)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo + 1 + file->line_delta;
+}
+
 // Reports an error message in the following format.
 //
 // foo.c:10: x = y + 1;
@@ -44,34 +136,59 @@ static void verror_at(char *filename, char *input, int line_no,
 }
 
 static void error_at(char *loc, char *fmt, ...) {
-    int line_no = 1;
-    for (char *p = current_input; p < loc; p++)
-        if (*p == '\n')
-            line_no++;
-
     va_list ap;
     va_start(ap, fmt);
-    verror_at(current_filename, current_input, line_no, loc, fmt, ap);
+    verror_at(current_file->name, current_file->contents,
+              find_line_no(current_file, loc), loc, fmt, ap);
     exit(1);
 }
 
 void error_tok(Token *tok, char *fmt, ...) {
+    File *file = get_file(tok);
     va_list ap;
     va_start(ap, fmt);
-    verror_at(tok->filename, tok->input, tok->line_no, tok->loc, fmt, ap);
+    verror_at(file->name, file->contents, get_line_no(tok), tok->loc, fmt, ap);
     exit(1);
 }
 
 void warn_tok(Token *tok, char *fmt, ...) {
+    File *file = get_file(tok);
     va_list ap;
     va_start(ap, fmt);
-    verror_at(tok->filename, tok->input, tok->line_no, tok->loc, fmt, ap);
+    verror_at(file->name, file->contents, get_line_no(tok), tok->loc, fmt, ap);
+}
+
+// Registers a new buffer in the file table.
+File *new_file(char *name, int file_no, char *contents) {
+    File *file = arena_alloc(&token_arena, sizeof(File));
+    file->name = name;
+    file->file_no = file_no;
+    file->contents = contents;
+
+    if (files_len == files_capacity) {
+        files_capacity = files_capacity ? files_capacity * 2 : 64;
+        files = realloc(files, sizeof(File *) * files_capacity);
+    }
+    file->id = files_len;
+    files[files_len++] = file;
+    return file;
+}
+
+File *get_file(Token *tok) {
+    return files[tok->file_id];
+}
+
+// Returns the line number of a given token. Line numbers are not
+// stored in tokens but computed from the line-start index that the
+// tokenizer builds for every file.
+int get_line_no(Token *tok) {
+    return find_line_no(get_file(tok), tok->loc);
 }
 
 // Consumes the current token if it matches `op`.
 bool equal(Token *tok, char *op) {
-    return strlen(op) == tok->len &&
-           !strncmp(tok->loc, op, tok->len);
+    return tok->loc[0] == op[0] && strlen(op) == tok->len &&
+           !memcmp(tok->loc, op, tok->len);
 }
 
 // Ensure that the current token is `op`.
@@ -92,32 +209,90 @@ bool consume(Token **rest, Token *tok, char *str) {
 
 // Create a new token and add it as the next token of `cur`.
 static Token *new_token(TokenKind kind, Token *cur, char *str, int len) {
-    Token *tok = calloc(1, sizeof(Token));
+    Token *tok = arena_alloc(&token_arena, sizeof(Token));
     tok->kind = kind;
     tok->loc = str;
     tok->len = len;
-    tok->filename = current_filename;
-    tok->input = current_input;
+    tok->file_id = current_file->id;
+    tok->at_bol = at_bol;
+    tok->has_space = has_space;
+    at_bol = has_space = false;
     cur->next = tok;
     return tok;
 }
 
-static bool startswith(char *p, char *q) {
-    return strncmp(p, q, strlen(q)) == 0;
+// Records that a new line starts at `p`. The tokenizer calls this
+// for every newline it passes over, so the line-start index of a file
+// is complete once the file has been tokenized.
+static void add_line_start(char *p) {
+    File *file = current_file;
+    if (file->nlines == line_starts_capacity) {
+        line_starts_capacity *= 2;
+        file->line_starts = realloc(file->line_starts,
+                                    sizeof(int) * line_starts_capacity);
+    }
+    file->line_starts[file->nlines++] = p - file->contents;
+}
+
+// Character classes. Every input byte is classified by a single
+// lookup into `char_class` instead of calling the locale-aware
+// <ctype.h> functions.
+enum {
+    CC_SPACE = 1,     // ' ', '\t', '\v', '\f' and '\r'
+    CC_NEWLINE = 2,   // '\n'
+    CC_DIGIT = 4,     // '0'-'9'
+    CC_HEX = 8,       // '0'-'9', 'a'-'f' and 'A'-'F'
+    CC_IDENT = 16,    // Letters, '_' and non-ASCII bytes
+    CC_PUNCT = 32,    // Punctuation characters
+    CC_EXPONENT = 64, // 'e', 'E', 'p' and 'P'
+};
+
+static unsigned char char_class[256];
+
+// The value of a digit in base 16, or 16 for non-digits.
+static unsigned char digit_value[256];
+
+static void init_char_class(void) {
+    for (int c = 0; c < 256; c++) {
+        digit_value[c] = 16;
+        if ('0' <= c && c <= '9')
+            digit_value[c] = c - '0';
+        if ('a' <= c && c <= 'f')
+            digit_value[c] = c - 'a' + 10;
+        if ('A' <= c && c <= 'F')
+            digit_value[c] = c - 'A' + 10;
+
+        if (c == ' ' || c == '\t' || c == '\v' || c == '\f' || c == '\r')
+            char_class[c] |= CC_SPACE;
+        if (c == '\n')
+            char_class[c] |= CC_NEWLINE;
+        if ('0' <= c && c <= '9')
+            char_class[c] |= CC_DIGIT | CC_HEX;
+        if (('a' <= c && c <= 'f') || ('A' <= c && c <= 'F'))
+            char_class[c] |= CC_HEX;
+        if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_' || c >= 0x80)
+            char_class[c] |= CC_IDENT;
+        if (c != '_' && 0x21 <= c && c <= 0x7e && !(char_class[c] & (CC_DIGIT | CC_IDENT)))
+            char_class[c] |= CC_PUNCT;
+        if (c == 'e' || c == 'E' || c == 'p' || c == 'P')
+            char_class[c] |= CC_EXPONENT;
+    }
 }
 
-static bool is_alpha(char c) {
-    return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t';
 }
 
-static bool is_alnum(char c) {
-    return is_alpha(c) || ('0' <= c && c <= '9');
+static bool is_digit(char c) {
+    return char_class[(unsigned char)c] & CC_DIGIT;
+}
+
+static bool is_ident2(char c) {
+    return char_class[(unsigned char)c] & (CC_IDENT | CC_DIGIT);
 }
 
 static bool is_hex(char c) {
-    return ('0' <= c && c <= '9') ||
-           ('a' <= c && c <= 'f') ||
-           ('A' <= c && c <= 'F');
+    return char_class[(unsigned char)c] & CC_HEX;
 }
 
 static int from_hex(char c) {
@@ -128,7 +303,141 @@ static int from_hex(char c) {
     return c - 'A' + 10;
 }
 
-static bool is_keyword(Token *tok) {
+// Scanning kernels. The tokenizer spends most of its time skipping
+// over comments, whitespace and string literals, so we find the next
+// interesting byte 16 or 32 bytes at a time with SSE2 or AVX2. AVX2
+// is used only if the CPU supports it.
+//
+// The kernels read whole aligned blocks, which may extend past the
+// terminating NUL but never cross a page boundary. Every set of bytes
+// we search for includes NUL, so a kernel never reads a block beyond
+// the one that contains the end of the buffer.
+enum {
+    SCAN_COMMENT, // '*' or NUL; records line starts on the way
+    SCAN_LINE,    // '\n' or NUL
+    SCAN_STRING,  // '"', '\\', '\n' or NUL
+    SCAN_SPACE,   // anything but ' ' and '\t'
+};
+
+#ifndef __SSE2__
+static char *scan_scalar(char *p, int set) {
+    switch (set) {
+        case SCAN_COMMENT:
+            for (; *p != '*' && *p != '\0'; p++)
+                if (*p == '\n')
+                    add_line_start(p + 1);
+            return p;
+        case SCAN_LINE:
+            while (*p != '\n' && *p != '\0')
+                p++;
+            return p;
+        case SCAN_STRING:
+            while (*p != '"' && *p != '\\' && *p != '\n' && *p != '\0')
+                p++;
+            return p;
+        default:
+            while (*p == ' ' || *p == '\t')
+                p++;
+            return p;
+    }
+}
+#endif
+
+#ifdef __SSE2__
+// Records the line starts after the newlines in a given bitmask.
+static void add_line_starts_mask(char *blk, unsigned int mask) {
+    for (; mask; mask &= mask - 1)
+        add_line_start(blk + __builtin_ctz(mask) + 1);
+}
+
+// GCC vector extensions let us compare a vector with a scalar, which
+// compiles to a single instruction with a constant operand even at -O0.
+typedef char v16qi __attribute__((vector_size(16)));
+typedef char v32qi __attribute__((vector_size(32)));
+
+static char *scan_sse2(char *p, int set) {
+    char *blk = (char *)((uintptr_t)p & ~(uintptr_t)15);
+    unsigned int valid = 0xFFFF & (0xFFFF << (p - blk));
+
+    for (;; blk += 16, valid = 0xFFFF) {
+        v16qi v = *(v16qi *)blk;
+        v16qi stop;
+        switch (set) {
+            case SCAN_COMMENT:
+                stop = (v == '*') | (v == '\0');
+                break;
+            case SCAN_LINE:
+                stop = (v == '\n') | (v == '\0');
+                break;
+            case SCAN_STRING:
+                stop = (v == '"') | (v == '\\') | (v == '\n') | (v == '\0');
+                break;
+            default:
+                stop = (v != ' ') & (v != '\t');
+                break;
+        }
+        unsigned int mask = _mm_movemask_epi8((__m128i)stop) & valid;
+
+        if (set == SCAN_COMMENT) {
+            unsigned int nl = _mm_movemask_epi8((__m128i)(v == '\n')) & valid;
+            if (mask)
+                nl &= (mask & -mask) - 1;
+            add_line_starts_mask(blk, nl);
+        }
+        if (mask)
+            return blk + __builtin_ctz(mask);
+    }
+}
+
+__attribute__((target("avx2")))
+static char *scan_avx2(char *p, int set) {
+    char *blk = (char *)((uintptr_t)p & ~(uintptr_t)31);
+    unsigned int valid = ~0u << (p - blk);
+
+    for (;; blk += 32, valid = ~0u) {
+        v32qi v = *(v32qi *)blk;
+        v32qi stop;
+        switch (set) {
+            case SCAN_COMMENT:
+                stop = (v == '*') | (v == '\0');
+                break;
+            case SCAN_LINE:
+                stop = (v == '\n') | (v == '\0');
+                break;
+            case SCAN_STRING:
+                stop = (v == '"') | (v == '\\') | (v == '\n') | (v == '\0');
+                break;
+            default:
+                stop = (v != ' ') & (v != '\t');
+                break;
+        }
+        unsigned int mask = _mm256_movemask_epi8((__m256i)stop) & valid;
+
+        if (set == SCAN_COMMENT) {
+            unsigned int nl = _mm256_movemask_epi8((__m256i)(v == '\n')) & valid;
+            if (mask)
+                nl &= (mask & -mask) - 1;
+            add_line_starts_mask(blk, nl);
+        }
+        if (mask)
+            return blk + __builtin_ctz(mask);
+    }
+}
+#endif
+
+// Returns the first byte at or after `p` in a given set.
+static char *(*scan)(char *p, int set);
+
+static void init_scan(void) {
+#ifdef __SSE2__
+    __builtin_cpu_init();
+    scan = __builtin_cpu_supports("avx2") ? scan_avx2 : scan_sse2;
+#else
+    scan = scan_scalar;
+#endif
+}
+
+static void init_keywords(void) {
     static char *kw[] = {
         "return",
         "if",
@@ -166,9 +475,63 @@ static bool is_keyword(Token *tok) {
     };
 
     for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-        if (equal(tok, kw[i]))
-            return true;
-    return false;
+        intern(kw[i], strlen(kw[i]))->is_keyword = true;
+}
+
+static bool is_keyword(Token *tok) {
+    return tok->u.atom->is_keyword;
+}
+
+// Encode a given character in UTF-8.
+static int encode_utf8(char *buf, int c) {
+    if (c <= 0x7F) {
+        buf[0] = c;
+        return 1;
+    }
+
+    if (c <= 0x7FF) {
+        buf[0] = 0b11000000 | (c >> 6);
+        buf[1] = 0b10000000 | (c & 0b00111111);
+        return 2;
+    }
+
+    if (c <= 0xFFFF) {
+        buf[0] = 0b11100000 | (c >> 12);
+        buf[1] = 0b10000000 | ((c >> 6) & 0b00111111);
+        buf[2] = 0b10000000 | (c & 0b00111111);
+        return 3;
+    }
+
+    buf[0] = 0b11110000 | (c >> 18);
+    buf[1] = 0b10000000 | ((c >> 12) & 0b00111111);
+    buf[2] = 0b10000000 | ((c >> 6) & 0b00111111);
+    buf[3] = 0b10000000 | (c & 0b00111111);
+    return 4;
+}
+
+static int read_universal_char(char *p, int len) {
+    long c = 0;
+    for (int i = 0; i < len; i++) {
+        if (!is_hex(p[i]))
+            return 0;
+        c = (c << 4) | from_hex(p[i]);
+    }
+
+    // Unicode code-space is limited to 21 bits.
+    // U+10FFFF is the largest valid code-point.
+    return (c <= 0x10FFFF) ? c : 0;
+}
+
+// Returns the length of a valid \u or \U escape sequence at `p`
+// and stores its code point to `*c`. Returns 0 if there is none.
+static int read_ucn(char *p, int *c) {
+    if (p[0] != '\\')
+        return 0;
+    if (p[1] == 'u' && (*c = read_universal_char(p + 2, 4)))
+        return 6;
+    if (p[1] == 'U' && (*c = read_universal_char(p + 2, 8)))
+        return 10;
+    return 0;
 }
 
 static char read_escaped_char(char **new_pos, char *p) {
@@ -224,99 +587,197 @@ static char read_escaped_char(char **new_pos, char *p) {
     }
 }
 
+// Returns NULL if the literal contains a backslash-newline.
+// Such a literal is read by read_spliced_token() instead.
 static Token *read_string_literal(Token *cur, char *start) {
     char *p = start + 1;
     char *end = p;
 
     // Find the closing double-quote.
-    for (; *end != '"'; end++) {
+    for (;; end++) {
+        end = scan(end, SCAN_STRING);
+        if (*end == '"')
+            break;
         if (*end == '\0')
             error_at(start, "unclosed string literal");
-        if (*end == '\\')
-            end++;
+        if (*end == '\n')
+            add_line_start(end + 1);
+        if (*end == '\\') {
+            if (end[1] == '\n')
+                return NULL;
+            if (end[1])
+                end++;
+        }
     }
 
     // Allocate a buffer that is large enough to hold the entire string.
-    char *buf = malloc(end - p + 1);
+    // A universal character name is never longer than its UTF-8 encoding.
+    char *buf = arena_alloc(&token_arena, end - p + 1);
     int len = 0;
 
     while (*p != '"') {
-        if (*p == '\\')
+        int c;
+        int n = read_ucn(p, &c);
+        if (n) {
+            len += encode_utf8(buf + len, c);
+            p += n;
+        } else if (*p == '\\') {
             buf[len++] = read_escaped_char(&p, p + 1);
-        else
+        } else {
             buf[len++] = *p++;
+        }
     }
 
     buf[len++] = '\0';
 
     Token *tok = new_token(TK_STR, cur, start, p - start + 1);
-    tok->contents = buf;
-    tok->cont_len = len;
+    tok->u.lit = arena_alloc(&token_arena, sizeof(Literal));
+    tok->u.lit->contents = buf;
+    tok->u.lit->cont_len = len;
     return tok;
 }
 
+// Returns NULL if the literal contains a backslash-newline.
 static Token *read_char_literal(Token *cur, char *start) {
     char *p = start + 1;
     if (*p == '\0')
         error_at(start, "unclosed char literal");
 
-    char c;
-    if (*p == '\\')
+    for (char *q = p; *q && *q != '\'' && *q != '\n'; q++) {
+        if (*q == '\\') {
+            if (q[1] == '\n')
+                return NULL;
+            if (q[1])
+                q++;
+        }
+    }
+
+    int c;
+    int n = read_ucn(p, &c);
+    if (n) {
+        // A non-ASCII character takes more than one byte in UTF-8.
+        if (c > 0x7F)
+            error_at(p, "char literal too long");
+        p += n;
+    } else if (*p == '\\') {
         c = read_escaped_char(&p, p + 1);
-    else
+    } else {
         c = *p++;
+    }
 
     if (*p != '\'')
         error_at(p, "char literal too long");
     p++;
 
     Token *tok = new_token(TK_NUM, cur, start, p - start);
-    tok->val = c;
-    tok->ty = ty_int;
+    tok->u.lit = arena_alloc(&token_arena, sizeof(Literal));
+    tok->u.lit->val = c;
+    tok->u.lit->ty = ty_int;
     return tok;
 }
 
-static bool convert_pp_int(Token *tok) {
+// Integer suffixes. "ll" has to be spelled in a single case.
+static struct {
+    char *name;
+    bool l;
+    bool u;
+} int_suffixes[] = {
+    {"u", false, true}, {"U", false, true},
+    {"l", true, false}, {"L", true, false},
+    {"ll", true, false}, {"LL", true, false},
+    {"ul", true, true}, {"uL", true, true},
+    {"Ul", true, true}, {"UL", true, true},
+    {"lu", true, true}, {"lU", true, true},
+    {"Lu", true, true}, {"LU", true, true},
+    {"ull", true, true}, {"uLL", true, true},
+    {"Ull", true, true}, {"ULL", true, true},
+    {"llu", true, true}, {"llU", true, true},
+    {"LLu", true, true}, {"LLU", true, true},
+};
+
+// Reads the value of an integer pp-number. Returns false if the token
+// is not an integer constant.
+static bool read_pp_int(Token *tok, unsigned long *val, int *base, bool *l, bool *u) {
     char *p = tok->loc;
+    char *end = tok->loc + tok->len;
 
     // Read a binary, octal, decimal or hexadecimal number.
-    int base = 10;
-    if (!strncasecmp(p, "0x", 2) && is_hex(p[2])) {
+    *base = 10;
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X') && is_hex(p[2])) {
         p += 2;
-        base = 16;
-    } else if (!strncasecmp(p, "0b", 2) && (p[2] == '0' || p[2] == '1')) {
+        *base = 16;
+    } else if (p[0] == '0' && (p[1] == 'b' || p[1] == 'B') &&
+               (p[2] == '0' || p[2] == '1')) {
         p += 2;
-        base = 2;
+        *base = 2;
     } else if (*p == '0') {
-        base = 8;
+        *base = 8;
     }
 
-    long val = strtoul(p, &p, base);
+    // Accumulate digits. An out-of-range value is saturated
+    // as strtoul() would do.
+    unsigned long v = 0;
+    unsigned long limit = ULONG_MAX / *base;
+    bool overflow = false;
+    for (; p < end; p++) {
+        int d = digit_value[(unsigned char)*p];
+        if (d >= *base)
+            break;
+        if (v > limit)
+            overflow = true;
+        unsigned long v2 = v * *base + d;
+        if (v2 < v * *base)
+            overflow = true;
+        v = v2;
+    }
 
     // Read U, L or LL suffixes.
-    bool l = false;
-    bool u = false;
-
-    if (startswith(p, "LLU") || startswith(p, "LLu") ||
-        startswith(p, "llU") || startswith(p, "llu") ||
-        startswith(p, "ULL") || startswith(p, "Ull") ||
-        startswith(p, "uLL") || startswith(p, "ull")) {
-        p += 3;
-        l = u = true;
-    } else if (!strncasecmp(p, "lu", 2) || !strncasecmp(p, "ul", 2)) {
-        p += 2;
-        l = u = true;
-    } else if (startswith(p, "LL") || startswith(p, "ll")) {
-        p += 2;
-        l = true;
-    } else if (*p == 'L' || *p == 'l') {
-        p++;
-        l = true;
-    } else if (*p == 'U' || *p == 'u') {
-        p++;
-        u = true;
+    *l = false;
+    *u = false;
+
+    if (p < end) {
+        int len = end - p;
+        int n = sizeof(int_suffixes) / sizeof(*int_suffixes);
+        int i = 0;
+        for (; i < n; i++)
+            if (!strncmp(int_suffixes[i].name, p, len) &&
+                int_suffixes[i].name[len] == '\0')
+                break;
+        if (i == n)
+            return false;
+        *l = int_suffixes[i].l;
+        *u = int_suffixes[i].u;
     }
 
+    if (overflow) {
+        warn_tok(tok, "integer constant is too large");
+        v = ULONG_MAX;
+    }
+
+    *val = v;
+    return true;
+}
+
+// Returns the value of an integer pp-number in a #if expression, where
+// every integer has the widest integer type. The value is unsigned if
+// it has a U suffix or does not fit in long. Returns false if the
+// token is not an integer constant.
+bool pp_int_value(Token *tok, unsigned long *val, bool *is_unsigned) {
+    int base;
+    bool l, u;
+    if (!read_pp_int(tok, val, &base, &l, &u))
+        return false;
+    *is_unsigned = u || (*val >> 63);
+    return true;
+}
+
+static bool convert_pp_int(Token *tok) {
+    unsigned long val;
+    int base;
+    bool l, u;
+    if (!read_pp_int(tok, &val, &base, &l, &u))
+        return false;
+
     // Infer a type.
     Type *ty;
     if (base == 10) {
@@ -345,12 +806,10 @@ static bool convert_pp_int(Token *tok) {
             ty = ty_int;
     }
 
-    if (p != tok->loc + tok->len)
-        return false;
-
     tok->kind = TK_NUM;
-    tok->val = val;
-    tok->ty = ty;
+    tok->u.lit = arena_alloc(&token_arena, sizeof(Literal));
+    tok->u.lit->val = val;
+    tok->u.lit->ty = ty;
     return true;
 }
 
@@ -361,7 +820,10 @@ static bool convert_pp_int(Token *tok) {
 // token after preprocessing.
 //
 // This function converts a pp-number token to a regular number token.
-static void convert_pp_number(Token *tok) {
+// It is called by the parser when it needs the value of a number, so
+// pp-numbers that are only pasted, stringized or printed by -E are
+// never converted.
+void convert_pp_number(Token *tok) {
     // Try to parse as an integer constant.
     if (convert_pp_int(tok))
         return;
@@ -385,8 +847,9 @@ static void convert_pp_number(Token *tok) {
         error_tok(tok, "invalid numeric constant");
 
     tok->kind = TK_NUM;
-    tok->fval = val;
-    tok->ty = ty;
+    tok->u.lit = arena_alloc(&token_arena, sizeof(Literal));
+    tok->u.lit->fval = val;
+    tok->u.lit->ty = ty;
 }
 
 void convert_pp_tokens(Token *tok) {
@@ -396,171 +859,522 @@ void convert_pp_tokens(Token *tok) {
                 if (is_keyword(t))
                     t->kind = TK_RESERVED;
                 continue;
-            case TK_PP_NUM:
-                convert_pp_number(t);
-                continue;
         }
     }
 }
 
-// Initialize token position info for all tokens.
-static void add_line_info(Token *tok) {
-    char *p = current_input;
-    int line_no = 1;
-    bool at_bol = true;
-    bool has_space = false;
+// Returns the length of a punctuator at `p`, or 0 if `p` does not
+// start with a punctuator. The first byte selects the handful of
+// candidates, so at most two more bytes are examined.
+static int read_punct(char *p) {
+    switch (*p) {
+        case '<':
+        case '>':
+            if (p[1] == *p)
+                return (p[2] == '=') ? 3 : 2;
+            return (p[1] == '=') ? 2 : 1;
+        case '.':
+            return (p[1] == '.' && p[2] == '.') ? 3 : 1;
+        case '+':
+        case '&':
+        case '|':
+            return (p[1] == *p || p[1] == '=') ? 2 : 1;
+        case '-':
+            return (p[1] == '-' || p[1] == '=' || p[1] == '>') ? 2 : 1;
+        case '=':
+        case '!':
+        case '*':
+        case '/':
+        case '%':
+        case '^':
+            return (p[1] == '=') ? 2 : 1;
+        case '#':
+            return (p[1] == '#') ? 2 : 1;
+    }
+    return (char_class[(unsigned char)*p] & CC_PUNCT) ? 1 : 0;
+}
+
+// Reads a token at `p`. Returns NULL if the token starts with a
+// universal character name or is a literal containing a
+// backslash-newline; such tokens are read by read_spliced_token().
+static Token *read_token(Token *cur, char *p) {
+    int cc = char_class[(unsigned char)*p];
+
+    // Identifier. Its hash value is computed while scanning
+    // so that it can be interned without another pass.
+    if (cc & CC_IDENT) {
+        char *q = p;
+        unsigned int hash = FNV_OFFSET;
+        do {
+            hash = (hash ^ (unsigned char)*p++) * FNV_PRIME;
+        } while (is_ident2(*p));
+        Token *tok = new_token(TK_IDENT, cur, q, p - q);
+        tok->u.atom = intern2(q, p - q, hash);
+        return tok;
+    }
 
-    do {
-        if (p == tok->loc) {
-            tok->line_no = line_no;
-            tok->at_bol = at_bol;
-            tok->has_space = has_space;
-            tok = tok->next;
+    // Numeric literal
+    if ((cc & CC_DIGIT) || (*p == '.' && is_digit(p[1]))) {
+        char *q = p++;
+        for (;;) {
+            int c = char_class[(unsigned char)*p];
+            if ((c & CC_EXPONENT) && (p[1] == '+' || p[1] == '-'))
+                p += 2;
+            else if ((c & (CC_IDENT | CC_DIGIT)) || *p == '.')
+                p++;
+            else
+                break;
         }
+        return new_token(TK_PP_NUM, cur, q, p - q);
+    }
 
-        if (*p == '\n') {
-            line_no++;
-            at_bol = true;
-        } else if (isspace(*p)) {
-            has_space = true;
+    // String literal
+    if (*p == '"')
+        return read_string_literal(cur, p);
+
+    // Character literal
+    if (*p == '\'')
+        return read_char_literal(cur, p);
+
+    // Identifier starting with a universal character name
+    int c;
+    if (read_ucn(p, &c))
+        return NULL;
+
+    // Punctuators
+    int len = read_punct(p);
+    if (len)
+        return new_token(TK_RESERVED, cur, p, len);
+
+    error_at(p, "invalid token");
+}
+
+// Returns true if a token ending at `end` may continue past a
+// backslash-newline or a universal character name.
+static bool is_spliced(Token *tok, char *end) {
+    if (*end != '\\')
+        return false;
+    if (end[1] == '\n')
+        return tok->kind != TK_STR && *tok->loc != '\'';
+
+    int c;
+    return (tok->kind == TK_IDENT || tok->kind == TK_PP_NUM) &&
+           read_ucn(end, &c);
+}
+
+// Returns the first character after backslash-newlines at `p`.
+static char *skip_splices(char *p) {
+    while (p[0] == '\\' && p[1] == '\n')
+        p += 2;
+    return p;
+}
+
+static void add_line_starts(char *p, char *end) {
+    for (; p < end; p++)
+        if (*p == '\n')
+            add_line_start(p + 1);
+}
+
+// Reads a token containing backslash-newlines or universal character
+// names. Such tokens are rare, so instead of complicating the fast
+// path, we copy the rest of the logical line to a scratch buffer with
+// backslash-newlines removed and universal character names converted
+// to UTF-8, read a token from the copy, and map its end back to the
+// input. The end is stored to `*rest`.
+static Token *read_spliced_token(Token *cur, char *start, char **rest) {
+    // Find the end of the logical line.
+    char *lim = start;
+    while (*lim && (*lim != '\n' || lim[-1] == '\\'))
+        lim++;
+
+    // pos[i] is the input position of buf[i].
+    int n = lim - start;
+    char *buf = arena_alloc(&token_arena, n + 1);
+    char **pos = malloc(sizeof(char *) * (n + 1));
+
+    int len = 0;
+    for (char *q = start; q < lim;) {
+        if (q[0] == '\\' && q[1] == '\n') {
+            q += 2;
+            continue;
+        }
+        pos[len] = q;
+        buf[len++] = *q++;
+    }
+    pos[len] = lim;
+
+    // Convert universal character names in place.
+    int j = 0;
+    for (int i = 0; i < len;) {
+        char *q = pos[i];
+        int c;
+        int k = read_ucn(buf + i, &c);
+        if (k) {
+            int m = encode_utf8(buf + j, c);
+            for (int x = 0; x < m; x++)
+                pos[j + x] = q;
+            i += k;
+            j += m;
+        } else if (buf[i] == '\\' && i + 1 < len) {
+            pos[j] = q;
+            buf[j++] = buf[i++];
+            pos[j] = pos[i];
+            buf[j++] = buf[i++];
         } else {
-            at_bol = false;
-            has_space = false;
+            pos[j] = q;
+            buf[j++] = buf[i++];
         }
-    } while (*p++);
+    }
+    pos[j] = pos[len];
+    buf[j] = '\0';
+
+    // Read a token from a scratch file that has the same name and
+    // line number as the input.
+    File *file = new_file(current_file->name, current_file->file_no, buf);
+    file->line_delta = find_line_no(current_file, start) - 1;
+    file->line_starts = calloc(1, sizeof(int));
+    file->nlines = 1;
+
+    File *orig = current_file;
+    current_file = file;
+    Token *tok = read_token(cur, buf);
+    current_file = orig;
+
+    *rest = pos[tok->len];
+    add_line_starts(start, *rest);
+    free(pos);
+    return tok;
 }
 
 // Tokenize a given string and returns new tokens.
-Token *tokenize(char *filename, int file_no, char *p) {
-    current_filename = filename;
-    current_input = p;
+static void init_tokenizer(void) {
+    static bool initialized;
+    if (!initialized) {
+        init_char_class();
+        init_keywords();
+        init_scan();
+        initialized = true;
+    }
+}
+
+static void init_lexer(Lexer *lx, File *file) {
+    init_tokenizer();
+    lx->file = file;
+    lx->p = file->contents;
+    lx->at_bol = true;
+    lx->has_space = false;
+    lx->in_directive = false;
+
+    lx->line_starts_capacity = 256;
+    file->line_starts = malloc(sizeof(int) * lx->line_starts_capacity);
+    file->nlines = 0;
+    file->line_starts[file->nlines++] = 0;
+}
+
+// The tokenizer works on global state, which is loaded from a lexer
+// when it resumes and stored back when it stops.
+static void load_lexer(Lexer *lx) {
+    current_file = lx->file;
+    at_bol = lx->at_bol;
+    has_space = lx->has_space;
+    line_starts_capacity = lx->line_starts_capacity;
+}
+
+static void store_lexer(Lexer *lx, char *p) {
+    lx->p = p;
+    lx->at_bol = at_bol;
+    lx->has_space = has_space;
+    lx->line_starts_capacity = line_starts_capacity;
+}
+
+// Tokenizes the input of a lexer. If `lazy` is false, the rest of the
+// input is tokenized. Otherwise, tokenization stops after the first
+// token of the line following a preprocessing directive, and the list
+// ends with a TK_MORE token from which lex_more() continues. The
+// preprocessor can then skip an excluded group without tokenizing it,
+// because a directive line and the first token of the next line are
+// all it needs to decide that.
+static Token *lex(Lexer *lx, bool lazy) {
+    long start_time = opt_stats ? now_nsec() : 0;
+    char *p = lx->p;
+    char *start = p;
+    load_lexer(lx);
+
     Token head = {};
     Token *cur = &head;
+    int ntokens = 0;
 
     while (*p) {
-        // Skip line comments.
-        if (startswith(p, "//")) {
-            p += 2;
-            while (*p != '\n')
-                p++;
-            continue;
-        }
-
-        // Skip block comments.
-        if (startswith(p, "/*")) {
-            char *q = strstr(p + 2, "*/");
-            if (!q)
-                error_at(p, "unclosed block comment");
-            p = q + 2;
-            continue;
-        }
+        int cc = char_class[(unsigned char)*p];
 
         // Skip whitespace characters.
-        if (isspace(*p)) {
+        if (cc & CC_SPACE) {
             p++;
+            // Most runs of blanks are short, so the scanning kernel
+            // is used only for long ones such as indentation.
+            if (is_blank(p[0]) && is_blank(p[1]) && is_blank(p[2]))
+                p = scan(p, SCAN_SPACE);
+            has_space = true;
             continue;
         }
 
-        // Numeric literal
-        if (isdigit(*p) || (p[0] == '.' && isdigit(p[1]))) {
-            char *q = p++;
-            for (;;) {
-                if (p[0] && p[1] && strchr("eEpP", p[0]) && strchr("+-", p[1]))
-                    p += 2;
-                else if (is_alnum(*p) || *p == '.')
-                    p++;
-                else
-                    break;
-            }
-            cur = new_token(TK_PP_NUM, cur, q, p - q);
+        if (cc & CC_NEWLINE) {
+            p++;
+            add_line_start(p);
+            at_bol = has_space = true;
             continue;
         }
 
-        // String literal
-        if (*p == '"') {
-            cur = read_string_literal(cur, p);
-            p += cur->len;
+        // A backslash-newline between tokens is simply removed.
+        if (*p == '\\' && p[1] == '\n') {
+            p += 2;
+            add_line_start(p);
             continue;
         }
 
-        // Character literal
-        if (*p == '\'') {
-            cur = read_char_literal(cur, p);
-            p += cur->len;
-            continue;
+        if (*p == '/') {
+            char *q = skip_splices(p + 1);
+
+            // Skip line comments. A backslash-newline continues
+            // a line comment to the next line.
+            if (*q == '/') {
+                add_line_starts(p, q);
+                for (q++;; q++) {
+                    q = scan(q, SCAN_LINE);
+                    if (*q == '\0' || q[-1] != '\\')
+                        break;
+                    add_line_start(q + 1);
+                }
+                p = q;
+                has_space = true;
+                continue;
+            }
+
+            // Skip block comments. A comment counts as a space.
+            if (*q == '*') {
+                add_line_starts(p, q);
+                for (q++;; q++) {
+                    q = scan(q, SCAN_COMMENT);
+                    if (*q == '\0')
+                        error_at(p, "unclosed block comment");
+                    char *r = skip_splices(q + 1);
+                    if (*r == '/') {
+                        add_line_starts(q, r);
+                        q = r + 1;
+                        break;
+                    }
+                }
+                p = q;
+                has_space = true;
+                continue;
+            }
         }
 
-        // Identifier
-        if (is_alpha(*p) || (*p & 0x80)) {
-            char *q = p++;
-            while (is_alnum(*p) || (*p & 0x80))
-                p++;
-            cur = new_token(TK_IDENT, cur, q, p - q);
-            continue;
+        bool bol = at_bol;
+        bool space = has_space;
+        Token *tok = read_token(cur, p);
+        char *end = tok ? p + tok->len : NULL;
+
+        if (!tok || is_spliced(tok, end)) {
+            at_bol = bol;
+            has_space = space;
+            tok = read_spliced_token(cur, p, &end);
         }
 
-        // Three-letter punctuators
-        if (startswith(p, "<<=") || startswith(p, ">>=") ||
-            startswith(p, "...")) {
-            cur = new_token(TK_RESERVED, cur, p, 3);
-            p += 3;
-            continue;
+        cur = tok;
+        p = end;
+        ntokens++;
+
+        // In lazy mode, stop after the first token of the line that
+        // follows a directive.
+        if (lazy && tok->at_bol) {
+            bool is_hash = (tok->len == 1 && *tok->loc == '#');
+            if (lx->in_directive) {
+                lx->in_directive = is_hash;
+                new_token(TK_MORE, cur, p, 0)->u.lexer = lx;
+                goto out;
+            }
+            lx->in_directive = is_hash;
         }
+    }
+
 
-        // Two-letter punctuators
-        if (startswith(p, "==") || startswith(p, "!=") ||
-            startswith(p, "<=") || startswith(p, ">=") ||
-            startswith(p, "->") || startswith(p, "+=") ||
-            startswith(p, "-=") || startswith(p, "*=") ||
-            startswith(p, "/=") || startswith(p, "++") ||
-            startswith(p, "--") || startswith(p, "%=") ||
-            startswith(p, "&=") || startswith(p, "|=") ||
-            startswith(p, "^=") || startswith(p, "&&") ||
-            startswith(p, "||") || startswith(p, "<<") ||
-            startswith(p, ">>") || startswith(p, "##")) {
-            cur = new_token(TK_RESERVED, cur, p, 2);
+    // The EOF token is always at the beginning of a line so that
+    // loops reading a line of tokens stop at it.
+    at_bol = true;
+    new_token(TK_EOF, cur, p, 0);
+
+out:
+    store_lexer(lx, p);
+
+    // Tokens are always counted, because -fpp-stats attributes them
+    // to files.
+    tokenize_stats.tokens = tokenize_stats.tokens + ntokens;
+    if (opt_stats) {
+        long bytes = p - start;
+        tokenize_stats.nsec = tokenize_stats.nsec + now_nsec() - start_time;
+        tokenize_stats.bytes = tokenize_stats.bytes + bytes;
+    }
+    return head.next;
+}
+
+Token *tokenize(File *file) {
+    Lexer lx;
+    init_lexer(&lx, file);
+    return lex(&lx, false);
+}
+
+// Continues tokenizing a file after a TK_MORE token.
+Token *lex_more(Lexer *lx) {
+    return lex(lx, true);
+}
+
+static char *skip_blanks_and_comments(char *p) {
+    for (;;) {
+        if (is_blank(*p) || *p == '\f' || *p == '\v' || *p == '\r') {
+            p++;
+        } else if (p[0] == '\\' && p[1] == '\n') {
             p += 2;
-            continue;
+            add_line_start(p);
+        } else if (p[0] == '/' && p[1] == '*') {
+            char *q = p + 2;
+            for (;; q++) {
+                q = scan(q, SCAN_COMMENT);
+                if (*q == '\0')
+                    return q;
+                char *r = skip_splices(q + 1);
+                if (*r == '/') {
+                    add_line_starts(q, r);
+                    q = r + 1;
+                    break;
+                }
+            }
+            p = q;
+        } else {
+            return p;
         }
+    }
+}
 
-        // Single-letter punctuators
-        if (ispunct(*p)) {
-            cur = new_token(TK_RESERVED, cur, p++, 1);
+// Skips to the end of a logical line and returns the beginning of the
+// next one. Comments and quoted text are skipped as a whole so that a
+// comment spanning lines does not end the line. An unterminated quote
+// ends at the newline, as is allowed in excluded groups.
+static char *skip_logical_line(char *p) {
+    for (;;) {
+        switch (*p) {
+        case '\0':
+            return p;
+        case '\n':
+            p++;
+            add_line_start(p);
+            if (p[-2] != '\\')
+                return p;
+            continue;
+        case '"':
+        case '\'': {
+            char quote = *p++;
+            while (*p != quote && *p != '\n' && *p != '\0')
+                p += (*p == '\\' && p[1] != '\0' && p[1] != '\n') ? 2 : 1;
+            if (*p == quote)
+                p++;
+            continue;
+        }
+        case '/':
+            if (p[1] == '*') {
+                p = skip_blanks_and_comments(p);
+                continue;
+            }
+            if (p[1] == '/') {
+                for (p = scan(p, SCAN_LINE); *p && p[-1] == '\\';) {
+                    add_line_start(p + 1);
+                    p = scan(p + 1, SCAN_LINE);
+                }
+                continue;
+            }
+            p++;
             continue;
+        default:
+            p++;
         }
+    }
+}
+
+static bool is_directive(char *p, int len, char *name) {
+    return strlen(name) == len && !memcmp(p, name, len);
+}
 
-        error_at(p, "invalid token");
+// Skips a group excluded by a conditional directive without tokenizing
+// it. `tok` is the first token of the group and must be followed by
+// TK_MORE. Lines are scanned for directives, and the tokens from the
+// #elif, #else or #endif that ends the group are returned.
+//
+// Returns NULL if `tok` came from a spliced line, which is rare. In
+// that case, the rest of the file is tokenized and linked after `tok`
+// so that the caller can skip the group token by token.
+Token *skip_excluded_group(Token *tok) {
+    Lexer *lx = tok->next->u.lexer;
+    if (tok->file_id != lx->file->id) {
+        tok->next = lex(lx, false);
+        return NULL;
     }
 
-    new_token(TK_EOF, cur, p, 0);
+    load_lexer(lx);
+    char *start = tok->loc;
+    char *p = start;
+    int depth = 0;
 
-    for (Token *t = head.next; t; t = t->next)
-        t->file_no = file_no;
-    add_line_info(head.next);
-    return head.next;
-}
+    while (*p) {
+        char *line = p;
+        p = skip_blanks_and_comments(p);
+        if (*p != '#') {
+            p = skip_logical_line(p);
+            continue;
+        }
 
-// Returns the contents of a given file.
-static char *read_file(char *path) {
-    FILE *fp;
+        char *hash = p;
+        p = skip_blanks_and_comments(p + 1);
+        char *name = p;
+        while (char_class[(unsigned char)*p] & (CC_IDENT | CC_DIGIT))
+            p++;
+        int len = p - name;
+
+        if (is_directive(name, len, "if") || is_directive(name, len, "ifdef") ||
+            is_directive(name, len, "ifndef")) {
+            depth++;
+        } else if (is_directive(name, len, "elif") || is_directive(name, len, "else") ||
+                   is_directive(name, len, "endif")) {
+            if (depth == 0) {
+                at_bol = true;
+                has_space = (hash != line);
+                p = hash;
+                break;
+            }
+            if (is_directive(name, len, "endif"))
+                depth--;
+        }
+        p = skip_logical_line(p);
+    }
 
-    if (strcmp(path, "-") == 0) {
-        // By convention, read from stdin if a given filename is "-".
-        fp = stdin;
-    } else {
-        fp = fopen(path, "r");
-        if (!fp)
-            return NULL;
+    if (opt_stats) {
+        long skipped = p - start;
+        tokenize_stats.skipped = tokenize_stats.skipped + skipped;
     }
 
-    int buflen = 4096;
-    int nread = 0;
+    store_lexer(lx, p);
+    lx->in_directive = false;
+    return lex(lx, true);
+}
+
+// Reads the entire stream into a newly allocated buffer.
+static char *read_stream(FILE *fp) {
+    size_t buflen = 4096;
+    size_t nread = 0;
     char *buf = malloc(buflen);
 
-    // Read the entire file.
     for (;;) {
-        int end = buflen - 2;  // extra 2 bytes for the trailing "\n\0"
-        int n = fread(buf + nread, 1, end - nread, fp);
+        size_t end = buflen - 2;  // extra 2 bytes for the trailing "\n\0"
+        size_t n = fread(buf + nread, 1, end - nread, fp);
         if (n == 0)
             break;
         nread += n;
@@ -570,9 +1384,6 @@ static char *read_file(char *path) {
         }
     }
 
-    if (fp != stdin)
-        fclose(fp);
-
     // Canonicalize the last line by appending "\n"
     // if it does not end with a newline.
     if (nread == 0 || buf[nread - 1] != '\n')
@@ -581,106 +1392,112 @@ static char *read_file(char *path) {
     return buf;
 }
 
-// Removes backslashes followed by a newline.
-static void remove_backslash_newline(char *p) {
-    char *q = p;
-
-    // We want to keep the number of newline characters so that
-    // the logical line number matches the physical one.
-    // This counter maintain the number of newlines we have removed.
-    int cnt = 0;
+// Returns the contents of a given file. The file's status is stored
+// to `st`, or st->st_mode is set to 0 if the file is read from stdin.
+//
+// A regular file whose size is not a multiple of the page size is
+// followed by zero bytes up to the end of its last mapped page, so
+// its mapping is already NUL-terminated and can be tokenized in place.
+//
+// This function is also called by the include prefetcher's worker
+// threads, so it must not touch any global state.
+char *read_file(char *path, struct stat *st) {
+    st->st_mode = 0;
 
-    while (*p) {
-        if (startswith(p, "\\\n")) {
-            p += 2;
-            cnt++;
-        } else if (*p == '\n') {
-            *q++ = *p++;
-            for (; cnt > 0; cnt--)
-                *q++ = '\n';
-        } else {
-            *q++ = *p++;
-        }
-    }
+    // By convention, read from stdin if a given filename is "-".
+    if (strcmp(path, "-") == 0)
+        return read_stream(stdin);
 
-    *q = '\0';
-}
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
 
-// Encode a given character in UTF-8.
-static int encode_utf8(char *buf, int c) {
-    if (c <= 0x7F) {
-        buf[0] = c;
-        return 1;
+    if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        FILE *fp = fopen(path, "r");
+        if (!fp)
+            return NULL;
+        char *buf = read_stream(fp);
+        fclose(fp);
+        return buf;
     }
 
-    if (c <= 0x7FF) {
-        buf[0] = 0b11000000 | (c >> 6);
-        buf[1] = 0b10000000 | (c & 0b00111111);
-        return 2;
+    size_t size = st->st_size;
+    char *map = NULL;
+    if (size > 0 && size % sysconf(_SC_PAGESIZE)) {
+        map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
     }
 
-    if (c <= 0xFFFF) {
-        buf[0] = 0b11100000 | (c >> 12);
-        buf[1] = 0b10000000 | ((c >> 6) & 0b00111111);
-        buf[2] = 0b10000000 | (c & 0b00111111);
-        return 3;
+    if (map) {
+        close(fd);
+        return map;
     }
 
-    buf[0] = 0b11110000 | (c >> 18);
-    buf[1] = 0b10000000 | ((c >> 12) & 0b00111111);
-    buf[2] = 0b10000000 | ((c >> 6) & 0b00111111);
-    buf[3] = 0b10000000 | (c & 0b00111111);
-    return 4;
-}
-
-static int read_universal_char(char *p, int len) {
-    long c = 0;
-    for (int i = 0; i < len; i++) {
-        if (!is_hex(p[i]))
-            return 0;
-        c = (c << 4) | from_hex(p[i]);
+    // Read the file into a buffer with room for the trailing "\n\0".
+    char *buf = malloc(size + 2);
+    size_t nread = 0;
+    while (nread < size) {
+        ssize_t n = read(fd, buf + nread, size - nread);
+        if (n <= 0)
+            break;
+        nread += n;
     }
+    close(fd);
 
-    // Unicode code-space is limited to 21 bits.
-    // U+10FFFF is the largest valid code-point.
-    return (c <= 0x10FFFF) ? c : 0;
+    if (nread == 0 || buf[nread - 1] != '\n')
+        buf[nread++] = '\n';
+    buf[nread] = '\0';
+    return buf;
 }
 
-// Replace \u or \U escape sequences with corresponding UTF-8 bytes.
-static void convert_universal_chars(char *p) {
-    char *q = p;
-
-    while (*p) {
-        int c;
-        if (startswith(p, "\\u") && (c = read_universal_char(p + 2, 4))) {
-            q += encode_utf8(q, c);
-            p += 6;
-        } else if (startswith(p, "\\U") && (c = read_universal_char(p + 2, 8))) {
-            q += encode_utf8(q, c);
-            p += 10;
-        } else if (p[0] == '\\') {
-            *q++ = *p++;
-            *q++ = *p++;
-        } else {
-            *q++ = *p++;
-        }
-    }
-
-    *q = '\0';
+// Allocates a file number and emits a .file directive for the
+// assembler. File numbers also identify files in the linemarkers of -E.
+int new_file_no(char *path) {
+    static int file_no;
+    file_no++;
+    if (!opt_E && !opt_emit_pch)
+        printf(".file %d \"%s\"\n", file_no, path);
+    return file_no;
 }
 
 Token *tokenize_file(char *path) {
-    char *p = read_file(path);
-    if (!p)
-        return NULL;
+    // Reading a file is accounted as part of tokenization.
+    long start_time = opt_stats ? now_nsec() : 0;
+    struct stat st;
+    char *p = NULL;
+    if (opt_prefetch_threads)
+        p = take_prefetched_file(path, &st);
+
+    if (!p) {
+        p = read_file(path, &st);
+        if (!p)
+            return NULL;
+        if (opt_prefetch_threads && S_ISREG(st.st_mode))
+            prefetch_includes(path, p, &st);
+    }
 
-    remove_backslash_newline(p);
-    convert_universal_chars(p);
+    File *file = new_file(path, new_file_no(path), p);
+    bool cacheable = opt_token_cache && S_ISREG(st.st_mode);
 
-    // Emit a .file directive for the assembler.
-    static int file_no;
-    if (!opt_E)
-        printf(".file %d \"%s\"\n", ++file_no, path);
+    Token *tok = NULL;
+    if (cacheable)
+        tok = load_cached_tokens(file, &st);
+
+    if (opt_stats) {
+        tokenize_stats.files++;
+        tokenize_stats.nsec = tokenize_stats.nsec + now_nsec() - start_time;
+    }
 
-    return tokenize(path, file_no, p);
+    if (!tok) {
+        // Files are tokenized lazily unless their tokens are cached,
+        // which requires all of them.
+        Lexer *lx = arena_alloc(&token_arena, sizeof(Lexer));
+        init_lexer(lx, file);
+        tok = lex(lx, !cacheable);
+        if (cacheable)
+            store_cached_tokens(file, &st, tok);
+    }
+    return tok;
 }
\ No newline at end of file
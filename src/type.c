@@ -22,7 +22,7 @@ Type *ty_float = &(Type){TY_FLOAT, 4, 4};
 Type *ty_double = &(Type){TY_DOUBLE, 8, 8};
 
 static Type *new_type(TypeKind kind, int size, int align) {
-    Type *ty = malloc(sizeof(Type));
+    Type *ty = arena_alloc(&type_arena, sizeof(Type));
     ty->kind = kind;
     ty->size = size;
     ty->align = align;
@@ -48,7 +48,7 @@ static bool is_scalar(Type *ty) {
 }
 
 Type *copy_type(Type *ty) {
-    Type *ret = malloc(sizeof(Type));
+    Type *ret = arena_alloc(&type_arena, sizeof(Type));
     *ret = *ty;
     return ret;
 }
@@ -68,7 +68,7 @@ Type *pointer_to(Type *base) {
 }
 
 Type *func_type(Type *return_ty) {
-    Type *ty = calloc(1, sizeof(Type));
+    Type *ty = arena_alloc(&type_arena, sizeof(Type));
     ty->kind = TY_FUNC;
     ty->return_ty = return_ty;
     return ty;
@@ -0,0 +1,4 @@
+#ifndef INCLUDE5_H
+#define INCLUDE5_H
+include5++;
+#endif
@@ -0,0 +1,6 @@
+#ifndef INCLUDE7_H
+#define INCLUDE7_H
+include7 += 1;
+#else
+include7 += 10;
+#endif
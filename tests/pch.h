@@ -0,0 +1,39 @@
+#ifndef PCH_H
+#define PCH_H
+
+#define PCH_SQUARE(x) ((x) * (x))
+#define PCH_CONCAT(x, y) x##y
+
+typedef struct {
+    int a;
+    char *s;
+} PchPair;
+
+struct pch_point {
+    int x, y;
+};
+
+// copy_type shares the member list of the struct with its const copy.
+struct pch_shared {
+    int a;
+    int b;
+    int c;
+};
+struct pch_shared pch_shared = {1, 2, 3};
+const struct pch_shared *pch_shared_ptr = &pch_shared;
+
+enum { PCH_RED = 3, PCH_GREEN };
+
+int pch_counter = 5;
+int *pch_counter_ptr = &pch_counter;
+
+static char *pch_name(int i) {
+    return i ? "green" : "red";
+}
+
+static int PCH_CONCAT(pch_, twice)(int x) {
+    struct pch_point p = {x, x};
+    return p.x + p.y;
+}
+
+#endif
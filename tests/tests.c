@@ -9,6 +9,7 @@ int main_line = __LINE__;
  */
 
 #include "include1.h"
+#include "pch.h"
 
 int printf();
 int exit();
@@ -1014,6 +1015,10 @@ int main() {
     assert(8, sizeof(0ll), "sizeof(0ll)");
     assert(8, sizeof(0x0L), "sizeof(0x0L)");
     assert(8, sizeof(0b0L), "sizeof(0b0L)");
+    assert(8, sizeof(0uLL), "sizeof(0uLL)");
+    assert(8, sizeof(0lU), "sizeof(0lU)");
+    assert(511, 0777, "0777");
+    assert(255, 0XfF, "0XfF");
     assert(4, sizeof(2147483647), "sizeof(2147483647)");
     assert(8, sizeof(2147483648), "sizeof(2147483648)");
     assert(-1, 0xffffffffffffffff, "0xffffffffffffffff");
@@ -1497,6 +1502,10 @@ int main() {
     assert(1, size\
 of(char),
            "sizeof(char)");
+    assert(0, strcmp("ab\
+c", "abc"), "strcmp(\"ab\\\nc\", \"abc\")");
+    assert(3, ({ int x=1; x +\
+= 2; x; }), "({ int x=1; x +\\\n= 2; x; })");
 
 #include "include3.h"
     assert(3, foo, "foo");
@@ -1514,6 +1523,110 @@ of(char),
 
 #undef foo
 
+    int include5 = 0;
+#include "include5.h"
+#include "include5.h"
+    assert(1, include5, "include5");
+#undef INCLUDE5_H
+#include "include5.h"
+    assert(2, include5, "include5");
+
+    int include6 = 0;
+#include "include6.h"
+#include "include6.h"
+#include "./include6.h"
+    assert(1, include6, "include6");
+
+    int include7 = 0;
+#include "include7.h"
+#include "include7.h"
+    assert(11, include7, "include7");
+
+#pragma nsc unknown pragma
+
+    int m17 = 1;
+#if 0
+#elif 0
+#endif
+    m17 = 2;
+    assert(2, m17, "m17");
+
+#if 0
+    m17 = "/*";
+/*
+#endif
+*/
+#if 1
+#else
+#endif
+    m17 = 3;
+# /**/ else
+    m17 = 4;
+#\
+endif
+    assert(4, m17, "m17");
+
+#define M14 1
+#define M15 2
+#define M16 3
+#undef M15
+#ifdef M15
+    assert(0, 1, "M15");
+#endif
+    assert(4, M14 + M16, "M14 + M16");
+#define M15 5
+    assert(5, M15, "M15");
+#undef M14
+#undef M15
+#undef M16
+#if defined(M14) || defined(M15) || defined(M16)
+    assert(0, 1, "M14 || M15 || M16");
+#endif
+
+    int m18 = 0;
+#if -1 < 0u || 1 || 1 / 0
+    m18 = 1;
+#endif
+    assert(1, m18, "m18");
+#if (0 ? 1 / 0 : 2) == 2 && '\n' == 10 && (2 + 3 * 4 << 1) == 28
+    m18 = 2;
+#endif
+    assert(2, m18, "m18");
+#define M18(x) (x + 1)
+#define M18_EMPTY
+#if M18(1) + M18(2) == 5 && defined M18 M18_EMPTY && !defined(M18_EMPTY) == 0
+    m18 = 3;
+#endif
+    assert(3, m18, "m18");
+#if M18
+    (1);
+#endif
+#undef M18
+#undef M18_EMPTY
+
+#define M19_BASE 1
+#define M19 (M19_BASE + 1)
+    assert(2, M19, "M19");
+    assert(2, M19, "M19");
+#undef M19_BASE
+#define M19_BASE 10
+    assert(11, M19, "M19");
+#undef M19_BASE
+    int M19_BASE = 5;
+    assert(6, M19, "M19");
+#undef M19
+
+    assert(9, PCH_SQUARE(3), "PCH_SQUARE(3)");
+    assert(4, PCH_GREEN, "PCH_GREEN");
+    assert(5, *pch_counter_ptr, "*pch_counter_ptr");
+    assert(10, pch_twice(5), "pch_twice(5)");
+    assert(0, strcmp(pch_name(1), "green"), "strcmp(pch_name(1), \"green\")");
+    assert(3, ({ PchPair p = {2, "hello"}; p.a + (p.s[1] == 'e'); }), "({ PchPair p = {2, \"hello\"}; p.a + (p.s[1] == 'e'); })");
+    assert(8, sizeof(struct pch_point), "sizeof(struct pch_point)");
+    assert(1, ({ struct pch_shared s; s.b = 1; s.b; }), "({ struct pch_shared s; s.b = 1; s.b; })");
+    assert(1, pch_shared_ptr->a, "pch_shared_ptr->a");
+    assert(3, pch_shared_ptr->c, "pch_shared_ptr->c");
+
     assert(1, __STDC__, "__STDC__");
 
     assert(0, strcmp(main_filename, "tests.c"), "strcmp(main_filename, \"tests.c\")");
@@ -1541,6 +1654,9 @@ of(char),
                       "d",
                       "abcd\nefgh"),
            "!strcmp(\"abc\" \"d\", \"abcd\\nefgh\")");
+    assert(4, sizeof("a\0" "b"), "sizeof(\"a\\0\" \"b\")");
+    assert(4, ("\x4" "1")[0], "(\"\\x4\" \"1\")[0]");
+    assert(0, strcmp("a" "b" "" "c" "de", "abcde"), "strcmp(\"a\" \"b\" \"\" \"c\" \"de\", \"abcde\")");
 
 #define CONCAT(x, y) x##y
     assert(5, ({ int f0zz=5; CONCAT(f,0zz); }), "({ int f0zz=5; CONCAT(f,0zz); })");
@@ -1588,6 +1704,7 @@ of(char),
 
     assert(18, Σ, "Σ");
     assert(3, ({ int β=3; β; }), "({ int β=3; β; })");
+    assert(3, ({ int \u03b2=3; β; }), "({ int \\u03b2=3; β; })");
     assert(3, ({ int あ=3; あ; }), "({ int あ=3; あ; })");
     assert(0, strcmp("日本語", "\u65E5\u672C\u8A9E"), "strcmp(\"日本語\", \"\\u65E5\\u672C\\u8A9E\")");
     assert(0, strcmp("日本語", "\U000065E5\U0000672C\U00008A9E"), "strcmp(\"日本語\", \"\\U000065E5\\U0000672C\\U00008A9E\")");